@@ -0,0 +1,446 @@
+/* Allocator benchmarks. The same source is linked once against the C
+ * library's malloc and once against xalloc; each run measures a single
+ * workload so that the peak RSS it reports is its own.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "../clock.h"
+
+#ifndef ALLOCATOR
+#define ALLOCATOR "glibc"
+#endif
+
+#define MAX_THREADS (64)
+#define SAMPLE_EVERY (8)
+#define MAX_SAMPLES (1 << 20)
+
+typedef struct {
+    int id;
+    uint64_t seed;
+    size_t ops;
+    size_t n_samples;
+    uint32_t *samples;
+} worker_t;
+
+typedef struct {
+    const char *name;
+    void *(*run)(void *arg);
+    int threaded;
+} workload_t;
+
+static int g_threads = 4;
+static size_t g_scale = 1;
+static pthread_barrier_t g_barrier;
+static char g_note[256];
+static void *volatile g_sink;
+
+static inline uint64_t rnd(worker_t *w)
+{
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 7;
+    w->seed ^= w->seed << 17;
+    return w->seed;
+}
+
+/* Mostly small requests, a tail of medium and a few large ones. */
+static size_t rnd_size(worker_t *w)
+{
+    uint64_t r = rnd(w);
+    if (r % 100 < 80)
+        return 8 + (r >> 8) % 249;
+    if (r % 100 < 95)
+        return 256 + (r >> 8) % 3841;
+    return 4096 + (r >> 8) % 61441;
+}
+
+static inline void record(worker_t *w, uint64_t ns)
+{
+    if (w->n_samples < MAX_SAMPLES)
+        w->samples[w->n_samples++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+/* Count every operation, time one in SAMPLE_EVERY of them. */
+#define TIMED(w, expr)                        \
+    do {                                      \
+        if ((w)->ops++ % SAMPLE_EVERY) {      \
+            expr;                             \
+        } else {                              \
+            uint64_t t0 = clock_ns();         \
+            expr;                             \
+            record((w), clock_ns() - t0);     \
+        }                                     \
+    } while (0)
+
+static inline void touch(void *ptr, size_t size)
+{
+    ((volatile char *) ptr)[0] = 1;
+    ((volatile char *) ptr)[size - 1] = 1;
+}
+
+/* Random alloc/free over a window of live objects. */
+static void *single(void *arg)
+{
+    worker_t *w = arg;
+    enum { SLOTS = 1024 };
+    void *slots[SLOTS] = {0};
+
+    for (size_t i = 0; i < 2000000 * g_scale; i++) {
+        size_t k = rnd(w) % SLOTS;
+        if (slots[k]) {
+            TIMED(w, free(slots[k]));
+            slots[k] = NULL;
+        } else {
+            size_t size = rnd_size(w);
+            TIMED(w, slots[k] = malloc(size));
+            touch(slots[k], size);
+        }
+    }
+    for (size_t k = 0; k < SLOTS; k++)
+        free(slots[k]);
+    return NULL;
+}
+
+/* Larson: server threads replace random objects, then hand their object
+ * sets over to the next thread, which frees what another one allocated.
+ */
+#define LARSON_SLOTS (1000)
+static void *g_larson[MAX_THREADS][LARSON_SLOTS];
+
+static void *larson(void *arg)
+{
+    worker_t *w = arg;
+
+    for (size_t round = 0; round < 20 * g_scale; round++) {
+        void **slots = g_larson[(w->id + round) % g_threads];
+        for (size_t i = 0; i < 50000; i++) {
+            size_t k = rnd(w) % LARSON_SLOTS;
+            size_t size = 16 + rnd(w) % 1009;
+            if (slots[k])
+                TIMED(w, free(slots[k]));
+            TIMED(w, slots[k] = malloc(size));
+            touch(slots[k], size);
+        }
+        pthread_barrier_wait(&g_barrier);
+    }
+    pthread_barrier_wait(&g_barrier);
+    if (w->id == 0) {
+        for (int t = 0; t < g_threads; t++) {
+            for (size_t k = 0; k < LARSON_SLOTS; k++)
+                free(g_larson[t][k]);
+        }
+    }
+    return NULL;
+}
+
+/* Hoard's threadtest: every thread allocates a batch and frees it all. */
+static void *threadtest(void *arg)
+{
+    worker_t *w = arg;
+    enum { BATCH = 10000 };
+    static __thread void *batch[BATCH];
+
+    for (size_t round = 0; round < 100 * g_scale; round++) {
+        for (size_t i = 0; i < BATCH; i++) {
+            TIMED(w, batch[i] = malloc(64));
+            touch(batch[i], 64);
+        }
+        for (size_t i = 0; i < BATCH; i++)
+            TIMED(w, free(batch[i]));
+    }
+    return NULL;
+}
+
+/* Producer/consumer pairs: every object is freed by another thread than
+ * the one that allocated it.
+ */
+#define RING_SIZE (1024)
+typedef struct {
+    void *slots[RING_SIZE];
+    size_t head, tail;
+} ring_t;
+static ring_t g_rings[MAX_THREADS / 2];
+
+static void *prodcons(void *arg)
+{
+    worker_t *w = arg;
+    ring_t *ring = &g_rings[w->id / 2];
+    size_t n = 500000 * g_scale;
+
+    for (size_t i = 0; i < n; i++) {
+        if (w->id % 2 == 0) {
+            size_t size = 16 + rnd(w) % 497;
+            void *ptr;
+            TIMED(w, ptr = malloc(size));
+            touch(ptr, size);
+            while (i - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >=
+                   RING_SIZE)
+                sched_yield();
+            ring->slots[i % RING_SIZE] = ptr;
+            __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
+        } else {
+            while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == i)
+                sched_yield();
+            void *ptr = ring->slots[i % RING_SIZE];
+            __atomic_store_n(&ring->head, i + 1, __ATOMIC_RELEASE);
+            TIMED(w, free(ptr));
+        }
+    }
+    return NULL;
+}
+
+/* Two buffers grown side by side to 1 MiB, as a reader filling them. */
+static void *realloc_growth(void *arg)
+{
+    worker_t *w = arg;
+
+    for (size_t round = 0; round < 400 * g_scale; round++) {
+        void *buf[2] = {NULL, NULL};
+        size_t size[2] = {16, 16};
+        while (size[0] < (1 << 20) || size[1] < (1 << 20)) {
+            size_t k = rnd(w) % 2;
+            if (size[k] >= (1 << 20))
+                k = !k;
+            size[k] += size[k] / 2 + rnd(w) % 64;
+            TIMED(w, buf[k] = realloc(buf[k], size[k]));
+            touch(buf[k], size[k]);
+        }
+        TIMED(w, free(buf[0]));
+        TIMED(w, free(buf[1]));
+    }
+    return NULL;
+}
+
+/* Fragmentation soak: leave holes behind every phase and ask for larger
+ * blocks than the holes, then see how much memory stays resident.
+ */
+static void *soak(void *arg)
+{
+    worker_t *w = arg;
+    enum { LIVE = 20000 };
+    static void *live[LIVE];
+
+    for (size_t phase = 0; phase < 20 * g_scale; phase++) {
+        size_t max = 1024 << (phase % 4);
+        for (size_t i = 0; i < LIVE; i++) {
+            if (live[i])
+                continue;
+            size_t size = 16 + rnd(w) % max;
+            TIMED(w, live[i] = malloc(size));
+            touch(live[i], size);
+        }
+        for (size_t i = phase % 2; i < LIVE; i += 2) {
+            TIMED(w, free(live[i]));
+            live[i] = NULL;
+        }
+    }
+    /* one survivor in eight pins the memory around it */
+    for (size_t i = 0; i < LIVE; i++) {
+        if (live[i] && rnd(w) % 8)
+            TIMED(w, free(live[i]));
+    }
+    return NULL;
+}
+
+/* Data TLB read misses of the calling thread, or -1 without a PMU. */
+static int tlb_counter(void)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HW_CACHE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CACHE_DTLB |
+                  PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                  PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+        .disabled = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long huge_kb(void)
+{
+    char line[128];
+    long kb = 0;
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "AnonHugePages: %ld", &kb) == 1)
+                break;
+        }
+        fclose(fp);
+    }
+    return kb;
+}
+
+/* TLB reach: 256 MB of 1 KB heap blocks chained in random order, then
+ * walked, so that nearly every step lands on another 4 KB page.
+ */
+static void *tlb(void *arg)
+{
+    worker_t *w = arg;
+    size_t n = ((size_t) 256 << 20) / 1024;
+    void **nodes = mmap(NULL, n * sizeof(void *), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint64_t misses = 0;
+
+    for (size_t i = 0; i < n; i++)
+        nodes[i] = malloc(1000);
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t k = rnd(w) % (i + 1);
+        void *tmp = nodes[i];
+        nodes[i] = nodes[k];
+        nodes[k] = tmp;
+    }
+    for (size_t i = 0; i < n; i++)
+        *(void **) nodes[i] = nodes[(i + 1) % n];
+
+    int fd = tlb_counter();
+    uint64_t start = clock_ns();
+    void *p = nodes[0];
+    if (fd >= 0)
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    for (size_t i = 0; i < 20000000 * g_scale; i++)
+        TIMED(w, p = *(void **) p);
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+            misses = 0;
+        close(fd);
+    }
+    double ns = (double) (clock_ns() - start) / w->ops;
+    if (fd >= 0)
+        snprintf(g_note, sizeof(g_note),
+                 "  %.1f ns/step  %.3f dTLB misses/step  AnonHugePages %ld KB",
+                 ns, (double) misses / w->ops, huge_kb());
+    else
+        snprintf(g_note, sizeof(g_note),
+                 "  %.1f ns/step  dTLB misses n/a  AnonHugePages %ld KB", ns,
+                 huge_kb());
+    for (size_t i = 0; i < n; i++)
+        free(nodes[i]);
+    munmap(nodes, n * sizeof(void *));
+    g_sink = p;
+    return NULL;
+}
+
+static const workload_t g_workloads[] = {
+    {"single", single, 0},         {"larson", larson, 1},
+    {"threadtest", threadtest, 1}, {"prodcons", prodcons, 1},
+    {"realloc", realloc_growth, 0}, {"soak", soak, 0},
+    {"tlb", tlb, 0},
+};
+#define N_WORKLOADS (sizeof(g_workloads) / sizeof(g_workloads[0]))
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static long rss_kb(void)
+{
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%*d %ld", &pages) != 1)
+            pages = 0;
+        fclose(fp);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s --header | WORKLOAD [THREADS [SCALE]]\n",
+            prog);
+    fprintf(stderr, "workloads:");
+    for (size_t i = 0; i < N_WORKLOADS; i++)
+        fprintf(stderr, " %s", g_workloads[i].name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const workload_t *load = NULL;
+    worker_t workers[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+
+    if (argc > 1 && !strcmp(argv[1], "--header")) {
+        printf("%-12s %-7s %12s %8s %8s %10s %10s\n", "workload",
+               "malloc", "ops/s", "p50(ns)", "p99(ns)", "peak(KB)",
+               "end(KB)");
+        return 0;
+    }
+    for (size_t i = 0; argc > 1 && i < N_WORKLOADS; i++) {
+        if (!strcmp(argv[1], g_workloads[i].name))
+            load = &g_workloads[i];
+    }
+    if (!load)
+        usage(argv[0]);
+    if (argc > 2)
+        g_threads = atoi(argv[2]);
+    if (argc > 3)
+        g_scale = strtoul(argv[3], NULL, 10);
+    if (g_threads < 1 || g_threads > MAX_THREADS || !g_scale)
+        usage(argv[0]);
+    if (!load->threaded)
+        g_threads = 1;
+    else if (load->run == prodcons && g_threads % 2)
+        g_threads++;
+
+    /* sample buffers stay out of the allocator under test */
+    size_t length = (size_t) MAX_SAMPLES * sizeof(uint32_t);
+    for (int i = 0; i < g_threads; i++) {
+        workers[i] = (worker_t){.id = i, .seed = 0x9E3779B97F4A7C15 * (i + 1)};
+        workers[i].samples = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (workers[i].samples == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+    }
+    pthread_barrier_init(&g_barrier, NULL, g_threads);
+
+    uint64_t start = clock_ns();
+    for (int i = 0; i < g_threads; i++)
+        pthread_create(&threads[i], NULL, load->run, &workers[i]);
+    for (int i = 0; i < g_threads; i++)
+        pthread_join(threads[i], NULL);
+    double seconds = (clock_ns() - start) / 1e9;
+
+    size_t ops = 0, n = 0;
+    uint32_t *all = mmap(NULL, length * g_threads, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (all == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    for (int i = 0; i < g_threads; i++) {
+        ops += workers[i].ops;
+        memcpy(all + n, workers[i].samples,
+               workers[i].n_samples * sizeof(uint32_t));
+        n += workers[i].n_samples;
+    }
+    qsort(all, n, sizeof(uint32_t), cmp_u32);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%-12s %-7s %12.0f %8u %8u %10ld %10ld\n", load->name, ALLOCATOR,
+           ops / seconds, n ? all[n / 2] : 0, n ? all[n * 99 / 100] : 0,
+           ru.ru_maxrss, rss_kb());
+    if (*g_note)
+        printf("%s\n", g_note);
+    return 0;
+}
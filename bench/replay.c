@@ -0,0 +1,421 @@
+/* Replay a trace recorded with XALLOC_TRACE against the allocator this is
+ * linked with. Events of all threads are merged by time and replayed from
+ * one thread; blocks are matched by the addresses they had when recorded.
+ * Built against xalloc, --report stops where the most requested bytes are
+ * live, or after the given number of events, and walks the heap there.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "../trace.h"
+#ifdef HEAP_REPORT
+#include "../xalloc.h"
+#endif
+
+#ifndef ALLOCATOR
+#define ALLOCATOR "glibc"
+#endif
+
+/* Recorded address -> replayed block, open addressing with linear probing;
+ * kept outside the allocator under test.
+ */
+typedef struct {
+    uint64_t id;
+    void *ptr;
+    size_t size;
+} entry_t;
+
+static entry_t *g_table;
+static size_t g_mask;
+static size_t g_live, g_peak_live;
+static size_t g_unmatched, g_reused;
+static size_t g_page;
+static size_t g_base, g_peak_heap;
+static double g_measure_seconds;
+
+static inline size_t slot_of(uint64_t id)
+{
+    return (id * 0x9E3779B97F4A7C15ULL >> 17) & g_mask;
+}
+
+static entry_t *lookup(uint64_t id)
+{
+    for (size_t i = slot_of(id);; i = (i + 1) & g_mask) {
+        if (g_table[i].id == id || !g_table[i].id)
+            return &g_table[i];
+    }
+}
+
+/* Entries that probed past @e move back over it, so that the lookups of
+ * later events never stop at a hole.
+ */
+static void erase(entry_t *e)
+{
+    size_t i = e - g_table;
+    g_live -= e->size;
+    for (size_t j = (i + 1) & g_mask; g_table[j].id; j = (j + 1) & g_mask) {
+        size_t home = slot_of(g_table[j].id);
+        if (((j - home) & g_mask) >= ((j - i) & g_mask)) {
+            g_table[i] = g_table[j];
+            i = j;
+        }
+    }
+    g_table[i].id = 0;
+}
+
+static void insert(uint64_t id, void *ptr, size_t size)
+{
+    entry_t *e = lookup(id);
+    if (e->id) {
+        /* a realloc stamped before a free it raced with */
+        g_reused++;
+        free(e->ptr);
+        erase(e);
+        e = lookup(id);
+    }
+    *e = (entry_t){.id = id, .ptr = ptr, .size = size};
+    g_live += size;
+    if (g_live > g_peak_live)
+        g_peak_live = g_live;
+}
+
+static void *take(uint64_t id)
+{
+    entry_t *e = lookup(id);
+    if (!e->id) {
+        g_unmatched++;
+        return NULL;
+    }
+    void *ptr = e->ptr;
+    erase(e);
+    return ptr;
+}
+
+/* One byte per page, so that the whole block is resident. */
+static void touch(void *ptr, size_t size)
+{
+    if (!ptr || !size)
+        return;
+    for (size_t i = 0; i < size; i += g_page)
+        ((volatile char *) ptr)[i] = (char) 0xA5;
+    ((volatile char *) ptr)[size - 1] = (char) 0xA5;
+}
+
+static int cmp_event(const void *a, const void *b)
+{
+    const trace_event_t *x = a, *y = b;
+    if (x->time != y->time)
+        return (x->time > y->time) - (x->time < y->time);
+    return (x > y) - (x < y);
+}
+
+/* Read with plain system calls: stdio would allocate. */
+static size_t rss_bytes(void)
+{
+    char buf[128];
+    long pages = 0;
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len > 0) {
+        buf[len] = '\0';
+        sscanf(buf, "%*d %ld", &pages);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+/* Resident memory above g_base, read each time the live bytes reach a new
+ * peak and once at the end; the time spent reading is kept off the clock.
+ */
+static void measure_heap(void)
+{
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    size_t rss = rss_bytes();
+    if (rss > g_base && rss - g_base > g_peak_heap)
+        g_peak_heap = rss - g_base;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    g_measure_seconds +=
+        (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+#ifdef HEAP_REPORT
+typedef struct {
+    size_t segments, committed, top_bytes;
+    size_t used_blocks, used_bytes;
+    size_t free_blocks, free_bytes, largest_free;
+    size_t cached_blocks, cached_bytes;
+    size_t slab_runs, slab_objects, slab_bytes;
+    size_t block_headers, segment_headers, run_headers;
+    size_t used_hist[STATS_BINS];
+    size_t free_hist[STATS_BINS];
+} report_t;
+
+/* Runs under every arena's mutex: no allocation here. */
+static int collect(const malloc_walk_t *rec, void *arg)
+{
+    report_t *r = arg;
+
+    switch (rec->kind) {
+    case MALLOC_WALK_SEGMENT:
+        r->segments++;
+        r->committed += rec->size;
+        r->segment_headers += rec->overhead;
+        break;
+    case MALLOC_WALK_USED:
+        r->used_blocks++;
+        r->used_bytes += rec->size;
+        r->used_hist[stats_bin(rec->size)]++;
+        r->block_headers += rec->overhead;
+        break;
+    case MALLOC_WALK_FREE:
+        r->free_blocks++;
+        r->free_bytes += rec->size;
+        r->free_hist[stats_bin(rec->size)]++;
+        if (rec->size > r->largest_free)
+            r->largest_free = rec->size;
+        r->block_headers += rec->overhead;
+        break;
+    case MALLOC_WALK_CACHED:
+        r->cached_blocks++;
+        r->cached_bytes += rec->size;
+        r->block_headers += rec->overhead;
+        break;
+    case MALLOC_WALK_TOP:
+        r->top_bytes += rec->size;
+        break;
+    case MALLOC_WALK_SLAB_RUN:
+        r->slab_runs++;
+        r->run_headers += rec->overhead;
+        break;
+    case MALLOC_WALK_SLAB_OBJECT:
+        r->slab_objects++;
+        r->slab_bytes += rec->size;
+        r->used_hist[stats_bin(rec->size)]++;
+        break;
+    }
+    return 0;
+}
+
+static void print_hist(const char *name, const size_t *hist)
+{
+    printf("%s:\n", name);
+    for (size_t i = 0; i < STATS_BINS; i++) {
+        char range[48];
+        if (!hist[i])
+            continue;
+        snprintf(range, sizeof(range), "[%zu, %zu)",
+                 i ? (size_t) 16 << i : 0, (size_t) 32 << i);
+        printf("  %-24s%zu\n", range, hist[i]);
+    }
+}
+
+/* Free bytes below the break of a segment are stranded: only the bytes
+ * past it can be trimmed. Mapped blocks are not walked.
+ */
+static void heap_report(size_t events)
+{
+    static report_t r;
+
+    malloc_walk(collect, &r);
+    size_t stranded = r.free_bytes + r.cached_bytes;
+    size_t meta = r.block_headers + r.segment_headers + r.run_headers;
+    printf("heap after %zu events\n", events);
+    printf("  %-22s%zu in %zu segments, %zu slab runs\n", "committed",
+           r.committed + r.slab_runs * SLAB_RUN_SIZE, r.segments, r.slab_runs);
+    printf("  %-22s%zu in %zu blocks, %zu in %zu slab objects\n", "used",
+           r.used_bytes, r.used_blocks, r.slab_bytes, r.slab_objects);
+    printf("  %-22s%zu in %zu blocks, largest %zu\n", "free", r.free_bytes,
+           r.free_blocks, r.largest_free);
+    printf("  %-22s%zu in %zu blocks\n", "cached", r.cached_bytes,
+           r.cached_blocks);
+    printf("  %-22s%.4f\n", "fragmentation",
+           r.free_bytes ? 1.0 - (double) r.largest_free / r.free_bytes : 0.0);
+    printf("  %-22s%zu\n", "stranded below break", stranded);
+    printf("  %-22s%zu\n", "trimmable past break", r.top_bytes);
+    printf("  %-22s%zu: block headers %zu, segments %zu, slab runs %zu\n",
+           "metadata", meta, r.block_headers, r.segment_headers,
+           r.run_headers);
+    print_hist("used_hist", r.used_hist);
+    print_hist("free_hist", r.free_hist);
+}
+
+/* The number of events after which the most requested bytes are live;
+ * the table is left empty.
+ */
+static size_t peak_event(const trace_event_t *events, size_t n)
+{
+    size_t at = n, peak = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const trace_event_t *ev = &events[i];
+        switch (ev->op) {
+        case TRACE_REALLOC:
+            if (ev->old)
+                take(ev->old);
+            /* fall through */
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+        case TRACE_MEMALIGN:
+            if (ev->ptr)
+                insert(ev->ptr, NULL, ev->size);
+            break;
+        case TRACE_FREE:
+            take(ev->ptr);
+            break;
+        }
+        if (g_live > peak) {
+            peak = g_live;
+            at = i + 1;
+        }
+    }
+    memset(g_table, 0, (g_mask + 1) * sizeof(entry_t));
+    g_live = g_peak_live = g_unmatched = g_reused = 0;
+    return at;
+}
+#endif
+
+static void *map(size_t length)
+{
+    void *ptr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return ptr;
+}
+
+int main(int argc, char **argv)
+{
+    struct stat st;
+    int fd;
+#ifdef HEAP_REPORT
+    const char *report = NULL;
+
+    if (argc == 3 && !strncmp(argv[1], "--report", 8) &&
+        (!argv[1][8] || argv[1][8] == '=')) {
+        report = argv[1][8] ? argv[1] + 9 : "";
+        argv++;
+        argc--;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s [--report[=EVENTS]] TRACE\n", argv[0]);
+        return 2;
+    }
+#else
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s TRACE\n", argv[0]);
+        return 2;
+    }
+#endif
+    if ((fd = open(argv[1], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    trace_header_t *header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE, fd, 0);
+    if ((size_t) st.st_size < sizeof(*header) || header == MAP_FAILED ||
+        header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+        header->event_size != sizeof(trace_event_t)) {
+        fprintf(stderr, "%s: not a version %d trace\n", argv[1],
+                TRACE_VERSION);
+        return 1;
+    }
+    trace_event_t *events = (trace_event_t *) (header + 1);
+    size_t n = (st.st_size - sizeof(*header)) / sizeof(trace_event_t);
+    qsort(events, n, sizeof(*events), cmp_event);
+
+    size_t capacity = 1024;
+    while (capacity < 2 * n)
+        capacity <<= 1;
+    g_page = sysconf(_SC_PAGESIZE);
+    g_table = map(capacity * sizeof(entry_t));
+    g_mask = capacity - 1;
+    memset(g_table, 0, capacity * sizeof(entry_t));
+#ifdef HEAP_REPORT
+    if (report && !*report)
+        n = peak_event(events, n);
+    else if (report && strtoul(report, NULL, 10) < n)
+        n = strtoul(report, NULL, 10);
+#endif
+
+    /* what the replay itself holds is resident by now */
+    g_base = rss_bytes();
+    size_t sampled_live = 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < n; i++) {
+        trace_event_t *ev = &events[i];
+        void *ptr;
+        if (g_peak_live > sampled_live) {
+            sampled_live = g_peak_live;
+            measure_heap();
+        }
+        switch (ev->op) {
+        case TRACE_MALLOC:
+            ptr = malloc(ev->size);
+            touch(ptr, ev->size);
+            if (ptr && ev->ptr)
+                insert(ev->ptr, ptr, ev->size);
+            break;
+        case TRACE_CALLOC:
+            ptr = calloc(ev->size, 1);
+            touch(ptr, ev->size);
+            if (ptr && ev->ptr)
+                insert(ev->ptr, ptr, ev->size);
+            break;
+        case TRACE_REALLOC:
+            ptr = ev->old ? take(ev->old) : NULL;
+            if (ev->old && !ptr)
+                break;
+            ptr = realloc(ptr, ev->size);
+            touch(ptr, ev->size);
+            if (ptr && ev->ptr)
+                insert(ev->ptr, ptr, ev->size);
+            break;
+        case TRACE_FREE:
+            free(take(ev->ptr));
+            break;
+        case TRACE_MEMALIGN:
+            if (posix_memalign(&ptr, ev->old < sizeof(void *)
+                                         ? sizeof(void *)
+                                         : ev->old,
+                               ev->size))
+                break;
+            touch(ptr, ev->size);
+            if (ev->ptr)
+                insert(ev->ptr, ptr, ev->size);
+            break;
+        }
+    }
+    measure_heap();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double seconds = (t1.tv_sec - t0.tv_sec) +
+                     (t1.tv_nsec - t0.tv_nsec) / 1e9 - g_measure_seconds;
+
+    /* the share of the peak heap not holding requested bytes: below 0 when
+     * the heap was measured short of its peak, 0 when it never grew */
+    double frag = g_peak_heap ? 1.0 - (double) g_peak_live / g_peak_heap : 0.0;
+    printf("%-7s events %zu  %.3f s  %.0f ops/s  peak live %zu KB  "
+           "peak heap %zu KB  fragmentation %.3f  unmatched %zu  "
+           "reused %zu\n",
+           ALLOCATOR, n, seconds, seconds > 0 ? n / seconds : 0.0,
+           g_peak_live / 1024,
+           g_peak_heap / 1024, frag, g_unmatched, g_reused);
+#ifdef HEAP_REPORT
+    if (report)
+        heap_report(n);
+#endif
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef __BITS
+#define __BITS
+#include <stddef.h>
+#include <stdint.h>
+
+/* The index of the highest bit set in @x, which is not 0. */
+static inline size_t msb(uint64_t x)
+{
+    return 63 - __builtin_clzll(x);
+}
+#endif /* __BITS */
@@ -0,0 +1,13 @@
+#ifndef __CLOCK
+#define __CLOCK
+#include <stdint.h>
+#include <time.h>
+
+/* Monotonic nanoseconds, for what outlives a time stamp counter read. */
+static inline uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif /* __CLOCK */
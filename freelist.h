@@ -0,0 +1,48 @@
+#ifndef __FREELIST
+#define __FREELIST
+#include <stddef.h>
+#include "heap.h"
+
+#define IS_FREE(x) ((x) ? (((metadata_t *) x)->free == YFREE) : (0))
+
+/* The index of free blocks lives inside the free blocks themselves, which
+ * are chained to the others of their size or class through the start of
+ * their payload.
+ */
+typedef struct freelink {
+    metadata_t *next, *prev;
+} freelink_t;
+
+#define FREE_LINK(x) ((freelink_t *) GET_PAYLOAD(x))
+
+extern const char *__progname;
+
+/* Which free block a heap allocation is carved from, set through
+ * XALLOC_PLACEMENT: the best fitting size, a recently freed one first
+ * (best); the block freed last whenever it fits, for cache-warm reuse
+ * (lifo); the best fitting size at the lowest address, so that blocks
+ * pack towards the start of their segment (address).
+ */
+enum placement {
+    PLACE_BEST,
+    PLACE_LIFO,
+    PLACE_ADDRESS,
+};
+
+extern int g_placement;
+
+/* Built with XALLOC_TLSF defined, free blocks are indexed by a two-level
+ * segregated fit instead of the LLRB tree, for bounded lookups.
+ */
+#ifdef XALLOC_TLSF
+#include "tlsf.h"
+#else
+#include "rbtree.h"
+#endif
+
+void insert_in_freed_list(free_index_t *index, metadata_t *new);
+void remove_from_freed_list(free_index_t *index, metadata_t *meta);
+metadata_t *search_freed_block(const free_index_t *index, size_t size);
+void freed_list_shape(const free_index_t *index, size_t *nodes,
+                      size_t *depth);
+#endif /* __FREELIST */
@@ -1,89 +1,402 @@
+#define _GNU_SOURCE
 #include "heap.h"
 #include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <unistd.h>
-static size_t page_remaining = 0;
-static void *first_block = NULL;
-static void *end_in_page = NULL;
-static metadata_t *last_node = NULL;
+#include "stats.h"
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
 static int page_size = 0;
+/* The free end of a segment is committed and trimmed in whole units. */
+static size_t unit_size;
+static int huge_pages = HUGE_OFF;
+size_t g_trim_threshold = TRIM_THRESHOLD_DEFAULT;
+size_t g_top_pad = TOP_PAD_DEFAULT;
+
+void heap_init(void)
+{
+    const char *mode = getenv("XALLOC_HUGEPAGES");
+
+    page_size = getpagesize();
+    if (mode && (*mode == '1' || *mode == '2'))
+        huge_pages = *mode - '0';
+    unit_size = huge_pages ? HUGE_PAGE_SIZE : (size_t) page_size;
+}
+
+static segment_t *find_segment(heap_t *heap, void *ptr)
+{
+    for (segment_t *seg = heap->segments; seg; seg = seg->next) {
+        if (ptr >= SEGMENT_FIRST(seg) && ptr < (void *) seg + seg->size)
+            return seg;
+    }
+    return NULL;
+}
 
 metadata_t *fusion(metadata_t *first, metadata_t *second)
 {
     first->size += second->size;
-    first->next = second->next;
-    if (first->next)
-        first->next->prev = first;
-    else
-        last_node = first;
     return first;
 }
 
-void change_break(metadata_t *node)
+static void set_fence(heap_t *heap, metadata_t *fence)
+{
+    fence->size = 0;
+    fence->free = FENCE;
+    fence->arena = heap->arena;
+    fence->flags = 0;
+}
+
+static void unmap_segment(heap_t *heap, segment_t *seg)
+{
+    if (seg->prev)
+        seg->prev->next = seg->next;
+    else
+        heap->segments = seg->next;
+    if (seg->next)
+        seg->next->prev = seg->prev;
+    munmap(seg, seg->size);
+    STATS_ADD(munmaps, 1);
+}
+
+/* Give back the whole pages lying more than @pad bytes past the fence of
+ * the segment; returns the number of bytes released.
+ */
+static size_t trim_segment(segment_t *seg, size_t pad)
 {
     size_t pages_to_remove;
 
-    if (node->prev) {
-        node->prev->next = NULL;
-        last_node = node->prev;
-        end_in_page = (void *) last_node + last_node->size;
-    } else {
-        end_in_page = last_node;
-        last_node = NULL;
+    pad += META_SIZE;
+    if (seg->page_remaining <= pad)
+        return 0;
+    pages_to_remove = (seg->page_remaining - pad) / unit_size;
+    if (!pages_to_remove)
+        return 0;
+    void *top = seg->end_in_page + seg->page_remaining;
+    size_t len = pages_to_remove * unit_size;
+    seg->page_remaining -= len;
+    STATS_ADD(madvises, 1);
+    if (!madvise(top - len, len, MADV_DONTNEED) &&
+        seg->zeroed_from > top - len)
+        seg->zeroed_from = top - len;
+    return len;
+}
+
+size_t heap_trim(heap_t *heap, size_t pad)
+{
+    size_t released = 0;
+
+    if (!page_size)
+        return 0;
+    for (segment_t *seg = heap->segments; seg; seg = seg->next)
+        released += trim_segment(seg, pad);
+    return released;
+}
+
+/* Called for the last block of a segment once it is free: the space joins
+ * the free end of the segment, which is only trimmed down to g_top_pad once
+ * it exceeds g_trim_threshold. A segment left empty is unmapped unless it is
+ * the one the heap currently grows.
+ */
+void change_break(heap_t *heap, metadata_t *node)
+{
+    segment_t *seg = find_segment(heap, node);
+
+    if ((void *) node == SEGMENT_FIRST(seg) && seg != heap->segments) {
+        unmap_segment(heap, seg);
+        return;
     }
-    page_remaining += node->size;
-    pages_to_remove = page_remaining / page_size;
-    /* FIXME: sbrk is deprecated */
-    brk((sbrk(0) - (pages_to_remove * page_size)));
-    page_remaining = page_remaining - (pages_to_remove * page_size);
+    seg->end_in_page = node;
+    seg->page_remaining += node->size;
+    set_fence(heap, node);
+    if (seg->page_remaining >= g_trim_threshold)
+        trim_segment(seg, g_top_pad);
 }
 
-static size_t get_new_page(size_t size)
+/* With huge pages, a segment starts on a huge page boundary: taken from
+ * hugetlbfs when it has pages reserved, otherwise carved out of a larger
+ * mapping and advised for transparent huge pages.
+ */
+static void *map_segment(size_t length)
 {
-    size_t pages = ((size / page_size) + 1) * page_size;
-    /* FIXME: sbrk is deprecated */
-    if (!end_in_page) {
-        if ((end_in_page = sbrk(0)) == (void *) -1)
-            return (size_t) -1;
-        first_block = end_in_page;
+    static bool no_hugetlb;
+    void *seg;
+
+    if (huge_pages == HUGE_TLB &&
+        !__atomic_load_n(&no_hugetlb, __ATOMIC_RELAXED)) {
+        seg = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB,
+                   -1, 0);
+        STATS_ADD(mmaps, 1);
+        if (seg != MAP_FAILED)
+            return seg;
+        __atomic_store_n(&no_hugetlb, true, __ATOMIC_RELAXED);
+    }
+    if (huge_pages == HUGE_OFF) {
+        seg = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        STATS_ADD(mmaps, 1);
+        return seg;
+    }
+
+    void *raw = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    STATS_ADD(mmaps, 1);
+    if (raw == MAP_FAILED)
+        return raw;
+    seg = (void *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) &
+                    -HUGE_PAGE_SIZE);
+    if (seg != raw) {
+        munmap(raw, seg - raw);
+        STATS_ADD(munmaps, 1);
     }
-    if (sbrk(pages) == (void *) -1) {
+    if (raw + HUGE_PAGE_SIZE != seg) {
+        munmap(seg + length, raw + HUGE_PAGE_SIZE - seg);
+        STATS_ADD(munmaps, 1);
+    }
+    madvise(seg, length, MADV_HUGEPAGE);
+    STATS_ADD(madvises, 1);
+    return seg;
+}
+
+static segment_t *new_segment(heap_t *heap, size_t size)
+{
+    size_t length = SEGMENT_SIZE;
+    if (size + SEGMENT_HEADER > length)
+        length = size + SEGMENT_HEADER;
+    length = (length + unit_size - 1) / unit_size * unit_size;
+
+    segment_t *seg = map_segment(length);
+    if (seg == MAP_FAILED) {
         errno = ENOMEM;
-        return (size_t) -1;
+        return NULL;
     }
-    return pages;
+    seg->size = length;
+    seg->page_remaining = unit_size - SEGMENT_HEADER;
+    seg->end_in_page = SEGMENT_FIRST(seg);
+    seg->zeroed_from = seg->end_in_page + META_SIZE;
+    set_fence(heap, seg->end_in_page);
+    seg->prev = NULL;
+    seg->next = heap->segments;
+    if (seg->next)
+        seg->next->prev = seg;
+    heap->segments = seg;
+    return seg;
 }
 
-static void *get_in_page(size_t size)
+/* Commit whole pages past the end of @seg so that it can hand out @size
+ * more bytes plus g_top_pad, if its reservation is large enough.
+ */
+static int commit_pages(segment_t *seg, size_t size)
 {
-    metadata_t *new = end_in_page;
+    size_t pages = (((size + g_top_pad) / unit_size) + 1) * unit_size;
+    void *top = seg->end_in_page + seg->page_remaining;
+    if ((size_t) ((void *) seg + seg->size - seg->end_in_page) < size)
+        return 0;
+    if (top + pages > (void *) seg + seg->size)
+        pages = (void *) seg + seg->size - top;
+    seg->page_remaining += pages;
+    return 1;
+}
+
+/* Grow the current segment, or start a new one when it cannot hold @size
+ * more bytes.
+ */
+static segment_t *get_new_page(heap_t *heap, size_t size)
+{
+    segment_t *seg = heap->segments;
+    if (!seg || !commit_pages(seg, size)) {
+        if (!(seg = new_segment(heap, size)))
+            return NULL;
+        commit_pages(seg, size);
+    }
+    return seg;
+}
+
+/* Move the fence of @seg @size bytes further; everything from zeroed_from
+ * on has never been handed out since the kernel mapped or zeroed it.
+ */
+static void push_fence(heap_t *heap, segment_t *seg, size_t size)
+{
+    seg->page_remaining -= size;
+    seg->end_in_page += size;
+    set_fence(heap, seg->end_in_page);
+    if (seg->end_in_page + META_SIZE > seg->zeroed_from)
+        seg->zeroed_from = seg->end_in_page + META_SIZE;
+}
+
+/* Bump-allocate @size bytes in place of the fence. */
+static void *get_in_page(heap_t *heap, segment_t *seg, size_t size,
+                         int *zeroed)
+{
+    metadata_t *new = seg->end_in_page;
+    *zeroed = GET_PAYLOAD(new) >= seg->zeroed_from;
+    push_fence(heap, seg, size);
     new->size = size;
     new->free = NFREE;
-    new->next = NULL;
-    new->prev = last_node;
-    if (last_node)
-        last_node->next = new;
-    last_node = new;
-    end_in_page = (void *) new + size;
+    new->arena = heap->arena;
+    new->flags = 0;
     return new;
 }
-void *get_heap(size_t size)
+
+/* Cut @node down to @size bytes and return the tail as a new in-use block,
+ * or NULL when the tail would be too small to ever be reused.
+ */
+metadata_t *split(metadata_t *node, size_t size)
 {
-    size_t tmp;
+    if (node->size < size + MIN_BLOCK_SIZE)
+        return NULL;
+
+    metadata_t *new = (void *) node + size;
+    new->size = node->size - size;
+    new->free = NFREE;
+    new->arena = node->arena;
+    new->flags = 0;
+    node->size = size;
+    NEXT_BLOCK(new)->flags &= ~PREV_FREE;
+    return new;
+}
+
+/* Grow the last block of a segment to @size bytes in place. */
+int extend_block(heap_t *heap, metadata_t *node, size_t size)
+{
+    segment_t *seg = find_segment(heap, node);
+    size_t delta = size - node->size;
+
+    if (!page_size)
+        page_size = getpagesize();
+    if (!seg || !IS_LAST(node))
+        return 0;
+    if (seg->page_remaining < delta + META_SIZE &&
+        !commit_pages(seg, delta + META_SIZE))
+        return 0;
+    push_fence(heap, seg, delta);
+    node->size = size;
+    return 1;
+}
+
+void *get_heap(heap_t *heap, size_t size, int *zeroed)
+{
+    segment_t *seg = heap->segments;
 
     if (!page_size)
         page_size = getpagesize();
 
-    if (page_remaining < size) {
-        if ((tmp = get_new_page(size)) == (size_t) -1)
+    /* room for the block and for the fence that follows it */
+    if (!seg || seg->page_remaining < size + META_SIZE) {
+        if (!(seg = get_new_page(heap, size + META_SIZE)))
             return NULL;
-        page_remaining += tmp;
     }
-    page_remaining -= size;
-    return get_in_page(size);
+    return get_in_page(heap, seg, size, zeroed);
 }
 
-int is_invalid_pointer(void *ptr)
+/* Walks the heap's segments: call with the owning arena's mutex held. */
+int is_invalid_pointer(heap_t *heap, void *ptr)
 {
     metadata_t *node = GET_NODE(ptr);
-    return ptr < first_block || ptr > end_in_page || !IS_VALID(node);
-}
\ No newline at end of file
+    if (IS_MAPPED(node)) {
+        size_t offset = ((size_t) node + META_SIZE) & (getpagesize() - 1);
+        return offset != META_SIZE && offset != 0;
+    }
+    segment_t *seg = find_segment(heap, node);
+    return !seg || (void *) node >= seg->end_in_page || !IS_VALID(node);
+}
+
+static inline size_t mapped_length(size_t size)
+{
+    if (!page_size)
+        page_size = getpagesize();
+    return ((size + page_size - 1) / page_size) * page_size;
+}
+
+/* Large blocks live in their own anonymous mapping, outside of any heap.
+ * Its header is at the start of the first page, or at the end of it for an
+ * aligned block, whose payload starts the second page; @size counts from
+ * the header.
+ */
+static inline size_t mapped_offset(metadata_t *node)
+{
+    return (size_t) node & (page_size - 1);
+}
+
+metadata_t *get_mapped(size_t size, uint32_t arena)
+{
+    size = mapped_length(size);
+    metadata_t *new = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    STATS_ADD(mmaps, 1);
+    if (new == MAP_FAILED) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    STATS_ADD(mapped_blocks, 1);
+    STATS_ADD(mapped_bytes, size);
+    new->size = size;
+    new->free = MMAPD;
+    new->arena = arena;
+    new->flags = 0;
+    return new;
+}
+
+/* Over-map by @align and unmap both ends around the aligned payload. */
+metadata_t *get_mapped_aligned(size_t size, size_t align, uint32_t arena)
+{
+    size = mapped_length(size);
+    if (align < (size_t) page_size)
+        align = page_size;
+    if (size > PTRDIFF_MAX - align) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *map = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    STATS_ADD(mmaps, 1);
+    if (map == MAP_FAILED) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *payload = (void *) (((size_t) map + page_size + align - 1) & -align);
+    void *head = payload - page_size;
+    if (head > map)
+        munmap(map, head - map);
+    if (map + align > payload)
+        munmap(payload + size, map + align - payload);
+    STATS_ADD(mapped_blocks, 1);
+    STATS_ADD(mapped_bytes, page_size + size);
+    metadata_t *new = GET_NODE(payload);
+    new->size = META_SIZE + size;
+    new->free = MMAPD;
+    new->arena = arena;
+    new->flags = 0;
+    return new;
+}
+
+metadata_t *resize_mapped(metadata_t *node, size_t size)
+{
+    size_t offset = mapped_offset(node);
+    size_t old_length = offset + node->size;
+    size_t length = mapped_length(offset + size);
+    void *map = mremap((void *) node - offset, old_length, length,
+                       MREMAP_MAYMOVE);
+    STATS_ADD(mremaps, 1);
+    if (map == MAP_FAILED) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    STATS_ADD(mapped_bytes, length - old_length);
+    metadata_t *new = map + offset;
+    new->size = length - offset;
+    return new;
+}
+
+void release_mapped(metadata_t *node)
+{
+    size_t offset = mapped_offset(node);
+    STATS_SUB(mapped_blocks, 1);
+    STATS_SUB(mapped_bytes, offset + node->size);
+    munmap((void *) node - offset, offset + node->size);
+    STATS_ADD(munmaps, 1);
+}
@@ -2,33 +2,119 @@
 #define __HEAP
 #include <stddef.h>
 #include <stdint.h>
+/* Blocks are laid out back to back, so the next one starts @size bytes
+ * further and a free block repeats its size in its last word, where its
+ * successor can find it when PREV_FREE is set in its flags.
+ */
 typedef struct metadata {
     size_t size;
-    size_t free;
-    struct metadata *next, *prev;
+    uint32_t free;
+    uint16_t arena;
+    uint16_t flags;
 } metadata_t;
 
+/* A heap is a list of mmap'ed segments, each bump-allocating its blocks
+ * from the first one after its header. Blocks never span two segments and
+ * the last one is always followed by a FENCE header at end_in_page.
+ */
+typedef struct segment {
+    struct segment *next, *prev;
+    size_t size;
+    size_t page_remaining;
+    void *end_in_page;
+    void *zeroed_from;
+} segment_t;
+
+typedef struct heap {
+    segment_t *segments;
+    uint32_t arena;
+} heap_t;
+
+#define YFREE 0x5EBA571E
+#define NFREE 0xDEADBEEF
+#define CFREE 0xCAC4EB1D
+#define MMAPD 0x3A9D3A9D
+#define FENCE 0xFE9CEFE9
+/* a heap block in use whose free must forget its sample (sample.h) */
+#define SAMPD 0x5A3B1ED0
+/* a heap block on the remote_free stack of its arena (xalloc.c) */
+#define RFREE 0x4E307EF4
+
+#define PREV_FREE 0x1
+
 #if __SIZE_WIDTH__ == 64
-#define YFREE 0xDEADBEEF5EBA571E
-#define NFREE 0x5EBA571EDEADBEEF
 #define ALIGN_BYTES(x) ((((x - 1) >> 4) << 4) + 16)
 #else
-#define YFREE 0x5EBA571E
-#define NFREE 0xDEADBEEF
 #define ALIGN_BYTES(x) ((((x - 1) >> 3) << 3) + 8)
 #endif
 
-#define SIZE_TAB_VALUES (256)
 #define META_SIZE ALIGN_BYTES((sizeof(metadata_t)))
 #define GET_PAYLOAD(x) ((void *) ((size_t) x + META_SIZE))
 #define GET_NODE(x) ((void *) ((size_t) x - META_SIZE))
-#define SIZE_DEFAULT_BLOCK (32)
-#define IS_VALID(x) \
-    (((metadata_t *) x)->free == YFREE || ((metadata_t *) x)->free == NFREE)
+#define SIZE_DEFAULT_BLOCK (48)
+#define MIN_BLOCK_SIZE (META_SIZE + SIZE_DEFAULT_BLOCK)
+#define IS_VALID(x)                                                          \
+    (((metadata_t *) x)->free == YFREE || ((metadata_t *) x)->free == NFREE || \
+     ((metadata_t *) x)->free == CFREE || ((metadata_t *) x)->free == MMAPD || \
+     ((metadata_t *) x)->free == SAMPD || ((metadata_t *) x)->free == RFREE)
+#define IS_MAPPED(x) (((metadata_t *) x)->free == MMAPD)
+#define NEXT_BLOCK(x) ((metadata_t *) ((size_t) x + ((metadata_t *) x)->size))
+#define PREV_BLOCK(x) ((metadata_t *) ((size_t) x - ((size_t *) x)[-1]))
+#define IS_LAST(x) (NEXT_BLOCK(x)->free == FENCE)
 
+#define SEGMENT_HEADER ALIGN_BYTES(sizeof(segment_t))
+#define SEGMENT_FIRST(x) ((void *) ((size_t) x + SEGMENT_HEADER))
+#if __SIZE_WIDTH__ == 64
+#define SEGMENT_SIZE (16UL << 20)
+#else
+#define SEGMENT_SIZE (1UL << 20)
+#endif
+/* Requests from this size on get their own mapping by default. */
+#define MMAP_THRESHOLD_DEFAULT (128UL << 10)
+/* The free end of a segment is only given back once it reaches
+ * g_trim_threshold, and g_top_pad bytes of it are kept for regrowth.
+ */
+#define TRIM_THRESHOLD_DEFAULT (128UL << 10)
+#define TOP_PAD_DEFAULT (128UL << 10)
+
+/* XALLOC_HUGEPAGES=1 maps heap segments on 2 MB boundaries and advises
+ * them for transparent huge pages; 2 takes them from hugetlbfs first. The
+ * free ends of segments are then committed and trimmed in whole huge pages,
+ * so that the kernel never has to split one.
+ */
+#define HUGE_PAGE_SIZE (2UL << 20)
+enum { HUGE_OFF, HUGE_THP, HUGE_TLB };
 
-void *get_heap(size_t size);
-void change_break(metadata_t *node);
-int is_invalid_pointer(void  *ptr);
+extern size_t g_trim_threshold;
+extern size_t g_top_pad;
+
+/* Free-state changes go through these two so that the boundary tags of the
+ * block and of its successor stay in sync.
+ */
+static inline void mark_free(metadata_t *node)
+{
+    metadata_t *next = NEXT_BLOCK(node);
+    node->free = YFREE;
+    ((size_t *) next)[-1] = node->size;
+    next->flags |= PREV_FREE;
+}
+
+static inline void mark_used(metadata_t *node)
+{
+    node->free = NFREE;
+    NEXT_BLOCK(node)->flags &= ~PREV_FREE;
+}
+
+void heap_init(void);
+void *get_heap(heap_t *heap, size_t size, int *zeroed);
+void change_break(heap_t *heap, metadata_t *node);
+size_t heap_trim(heap_t *heap, size_t pad);
+int is_invalid_pointer(heap_t *heap, void *ptr);
 metadata_t *fusion(metadata_t *first, metadata_t *second);
-#endif
\ No newline at end of file
+metadata_t *split(metadata_t *node, size_t size);
+int extend_block(heap_t *heap, metadata_t *node, size_t size);
+metadata_t *get_mapped(size_t size, uint32_t arena);
+metadata_t *get_mapped_aligned(size_t size, size_t align, uint32_t arena);
+metadata_t *resize_mapped(metadata_t *node, size_t size);
+void release_mapped(metadata_t *node);
+#endif
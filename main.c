@@ -1,7 +1,8 @@
-#include "heap.h"
+#include "xalloc.h"
 
 int main()
 {
-    void *x = get_heap(4);
+    void *x = malloc(4);
+    free(x);
     return 0;
 }
\ No newline at end of file
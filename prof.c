@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include "prof.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "bits.h"
+#include "clock.h"
+
+typedef struct prof_hist {
+    uint64_t counts[PROF_OPS][PROF_CLASSES][PROF_KINDS][PROF_BUCKETS];
+    struct prof_hist *next, *prev;
+} prof_hist_t;
+
+/* Lock times add up over a sampled call, and are counted once it returns. */
+typedef struct {
+    prof_hist_t *hist;
+    uint64_t wait, hold;
+    uint32_t countdown;
+    bool sampled;
+    bool locked;
+    bool closed;
+} prof_thread_t;
+
+bool g_prof_enabled;
+static char g_prof_path[4096];
+static uint64_t g_prof_ticks, g_prof_ns;
+static uint32_t g_prof_rate = PROF_RATE_DEFAULT;
+static pthread_mutex_t g_prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+static prof_hist_t *g_prof_live;    /* one per running thread */
+static prof_hist_t *g_prof_spare;   /* left by exited threads */
+static prof_hist_t g_prof_retired;  /* what exited threads counted */
+static pthread_mutex_t g_dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static prof_hist_t g_dump;
+
+static __thread prof_thread_t t_prof;
+
+static const char *const g_op_names[PROF_OPS] = {
+    "malloc", "calloc", "realloc", "free", "memalign",
+};
+static const char *const g_kind_names[PROF_KINDS] = {
+    "latency", "lock wait", "lock hold",
+};
+
+static inline size_t class_of(size_t size)
+{
+    if (size < 64)
+        return 0;
+    size_t class = (msb(size) - 6) / 2 + 1;
+    return class < PROF_CLASSES ? class : PROF_CLASSES - 1;
+}
+
+static inline size_t bucket_of(uint64_t ticks)
+{
+    if (!ticks)
+        return 0;
+    size_t bucket = msb(ticks);
+    return bucket < PROF_BUCKETS ? bucket : PROF_BUCKETS - 1;
+}
+
+void prof_init(void)
+{
+    const char *path = getenv("XALLOC_PROF");
+
+    if (!path || !*path || strlen(path) >= sizeof(g_prof_path))
+        return;
+    strcpy(g_prof_path, path);
+    if ((path = getenv("XALLOC_PROF_RATE")) && atoi(path) > 0)
+        g_prof_rate = atoi(path);
+    g_prof_ticks = prof_ticks();
+    g_prof_ns = clock_ns();
+    g_prof_enabled = true;
+}
+
+/* Histograms are mapped rather than allocated, and kept for reuse. */
+static prof_hist_t *thread_hist(void)
+{
+    prof_hist_t *hist;
+
+    pthread_mutex_lock(&g_prof_mutex);
+    if ((hist = g_prof_spare)) {
+        g_prof_spare = hist->next;
+        memset(hist->counts, 0, sizeof(hist->counts));
+    } else {
+        hist = mmap(NULL, sizeof(*hist), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (hist == MAP_FAILED)
+            hist = NULL;
+    }
+    if (hist) {
+        hist->prev = NULL;
+        hist->next = g_prof_live;
+        if (g_prof_live)
+            g_prof_live->prev = hist;
+        g_prof_live = hist;
+    }
+    pthread_mutex_unlock(&g_prof_mutex);
+    return t_prof.hist = hist;
+}
+
+/* Returns 0 for the calls left out of the sample. */
+uint64_t prof_begin(void)
+{
+    if (t_prof.countdown > 1) {
+        t_prof.countdown--;
+        return 0;
+    }
+    t_prof.countdown = g_prof_rate;
+    t_prof.wait = t_prof.hold = 0;
+    t_prof.sampled = true;
+    t_prof.locked = false;
+    return prof_ticks();
+}
+
+uint64_t prof_lock_start(void)
+{
+    return t_prof.sampled ? prof_ticks() : 0;
+}
+
+void prof_lock(uint64_t wait)
+{
+    t_prof.wait += wait;
+    t_prof.locked = true;
+}
+
+void prof_unlock(uint64_t hold)
+{
+    t_prof.hold += hold;
+}
+
+void prof_end(uint32_t op, size_t size, uint64_t start)
+{
+    uint64_t now = prof_ticks();
+    prof_hist_t *hist = t_prof.hist;
+
+    t_prof.sampled = false;
+    if (t_prof.closed || (!hist && !(hist = thread_hist())))
+        return;
+    uint64_t(*row)[PROF_BUCKETS] = hist->counts[op][class_of(size)];
+    row[PROF_LATENCY][bucket_of(now - start)]++;
+    if (t_prof.locked) {
+        row[PROF_WAIT][bucket_of(t_prof.wait)]++;
+        row[PROF_HOLD][bucket_of(t_prof.hold)]++;
+    }
+}
+
+static void add_counts(prof_hist_t *dst, const prof_hist_t *src)
+{
+    uint64_t *d = &dst->counts[0][0][0][0];
+    const uint64_t *s = &src->counts[0][0][0][0];
+    for (size_t i = 0; i < sizeof(dst->counts) / sizeof(uint64_t); i++)
+        d[i] += s[i];
+}
+
+/* An exiting thread folds its counts into the retired ones; calls it makes
+ * from then on are not counted.
+ */
+void prof_thread_exit(void)
+{
+    prof_hist_t *hist = t_prof.hist;
+
+    t_prof.closed = true;
+    if (!hist)
+        return;
+    pthread_mutex_lock(&g_prof_mutex);
+    add_counts(&g_prof_retired, hist);
+    if (hist->prev)
+        hist->prev->next = hist->next;
+    else
+        g_prof_live = hist->next;
+    if (hist->next)
+        hist->next->prev = hist->prev;
+    hist->next = g_prof_spare;
+    g_prof_spare = hist;
+    pthread_mutex_unlock(&g_prof_mutex);
+    t_prof.hist = NULL;
+}
+
+/* g_prof_mutex never waits for another lock: it is taken last before
+ * fork(). A dump under way in another thread leaves g_dump_mutex held,
+ * which the child starts over.
+ */
+void prof_fork_prepare(void)
+{
+    pthread_mutex_lock(&g_prof_mutex);
+}
+
+void prof_fork_parent(void)
+{
+    pthread_mutex_unlock(&g_prof_mutex);
+}
+
+void prof_fork_child(void)
+{
+    pthread_mutex_init(&g_prof_mutex, NULL);
+    pthread_mutex_init(&g_dump_mutex, NULL);
+}
+
+/* The upper bound of the bucket holding the @q-th quantile. */
+static uint64_t quantile(const uint64_t *buckets, uint64_t count, double q)
+{
+    uint64_t rank = count * q, seen = 0;
+    for (size_t i = 0; i < PROF_BUCKETS; i++) {
+        if ((seen += buckets[i]) > rank)
+            return (uint64_t) 2 << i;
+    }
+    return (uint64_t) 2 << (PROF_BUCKETS - 1);
+}
+
+static void print_row(FILE *fp, size_t op, size_t class, size_t kind,
+                      const uint64_t *buckets, double per_ns)
+{
+    uint64_t count = 0, max = 0;
+    char range[48];
+
+    for (size_t i = 0; i < PROF_BUCKETS; i++) {
+        count += buckets[i];
+        if (buckets[i])
+            max = (uint64_t) 2 << i;
+    }
+    if (!count)
+        return;
+    if (class == PROF_CLASSES - 1)
+        snprintf(range, sizeof(range), "[%zu, -)", (size_t) 16 << 2 * class);
+    else
+        snprintf(range, sizeof(range), "[%zu, %zu)",
+                 class ? (size_t) 16 << 2 * class : 0,
+                 (size_t) 64 << 2 * class);
+    fprintf(fp, "%-9s%-16s%-10s%12llu%10.0f%10.0f%12.0f\n", g_op_names[op],
+            range, g_kind_names[kind], (unsigned long long) count,
+            quantile(buckets, count, 0.5) / per_ns,
+            quantile(buckets, count, 0.99) / per_ns, max / per_ns);
+    for (size_t i = 0; i < PROF_BUCKETS; i++) {
+        if (!buckets[i])
+            continue;
+        snprintf(range, sizeof(range), "[%llu, %llu)",
+                 i ? 1ULL << i : 0ULL, 2ULL << i);
+        fprintf(fp, "    %-24s%llu\n", range,
+                (unsigned long long) buckets[i]);
+    }
+}
+
+/* Sum the histograms of every thread, live or gone, and print them: one
+ * summary line per operation, size class and kind of time, in ns, and its
+ * buckets in ticks. Returns -1 when the profiler is off.
+ */
+int prof_dump(FILE *fp)
+{
+    if (!g_prof_enabled)
+        return -1;
+
+    pthread_mutex_lock(&g_dump_mutex);
+    pthread_mutex_lock(&g_prof_mutex);
+    memcpy(g_dump.counts, g_prof_retired.counts, sizeof(g_dump.counts));
+    for (prof_hist_t *hist = g_prof_live; hist; hist = hist->next)
+        add_counts(&g_dump, hist);
+    pthread_mutex_unlock(&g_prof_mutex);
+
+    uint64_t ns = clock_ns() - g_prof_ns;
+    double per_ns = ns ? (double) (prof_ticks() - g_prof_ticks) / ns : 1.0;
+    fprintf(fp, "ticks per ns: %.3f, one call in %u sampled\n", per_ns,
+            g_prof_rate);
+    fprintf(fp, "%-9s%-16s%-10s%12s%10s%10s%12s\n", "op", "size", "time",
+            "count", "p50(ns)", "p99(ns)", "max(ns)");
+    for (size_t op = 0; op < PROF_OPS; op++) {
+        for (size_t class = 0; class < PROF_CLASSES; class++) {
+            for (size_t kind = 0; kind < PROF_KINDS; kind++)
+                print_row(fp, op, class, kind,
+                          g_dump.counts[op][class][kind], per_ns);
+        }
+    }
+    pthread_mutex_unlock(&g_dump_mutex);
+    return 0;
+}
+
+__attribute__((destructor)) static void prof_exit(void)
+{
+    char name[sizeof(g_prof_path) + 16];
+
+    if (!g_prof_enabled)
+        return;
+    snprintf(name, sizeof(name), "%s.%d", g_prof_path, (int) getpid());
+    FILE *fp = fopen(name, "w");
+    if (fp) {
+        prof_dump(fp);
+        fclose(fp);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef __PROF
+#define __PROF
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include "clock.h"
+#endif
+
+/* With XALLOC_PROF=path in the environment, one malloc, calloc, realloc,
+ * free or aligned allocation in XALLOC_PROF_RATE (PROF_RATE_DEFAULT) of
+ * each thread is timed into per-thread histograms, along with the time the
+ * call waited for and held its arena's mutex. Other calls only count down
+ * to the next sample. The histograms are written to path.<pid> at exit, or
+ * on demand through malloc_prof_dump().
+ */
+#define PROF_RATE_DEFAULT (16)
+
+enum prof_op {
+    PROF_MALLOC,
+    PROF_CALLOC,
+    PROF_REALLOC,
+    PROF_FREE,
+    PROF_MEMALIGN,
+    PROF_OPS,
+};
+
+enum prof_kind {
+    PROF_LATENCY,
+    PROF_WAIT,
+    PROF_HOLD,
+    PROF_KINDS,
+};
+
+/* Size classes go by powers of four from 64 bytes, and the buckets of a
+ * histogram by powers of two of the tick count.
+ */
+#define PROF_CLASSES (8)
+#define PROF_BUCKETS (32)
+
+extern bool g_prof_enabled;
+
+#define PROFILING() __builtin_expect(g_prof_enabled, 0)
+
+/* The time stamp counter where there is one: a few cycles per read. */
+static inline uint64_t prof_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return clock_ns();
+#endif
+}
+
+#define PROF_BEGIN() (PROFILING() ? prof_begin() : 0)
+#define PROF_END(op, size, start)              \
+    do {                                       \
+        if (PROFILING() && (start))            \
+            prof_end((op), (size), (start));   \
+    } while (0)
+
+void prof_init(void);
+uint64_t prof_begin(void);
+void prof_end(uint32_t op, size_t size, uint64_t start);
+uint64_t prof_lock_start(void);
+void prof_lock(uint64_t wait);
+void prof_unlock(uint64_t hold);
+void prof_thread_exit(void);
+void prof_fork_prepare(void);
+void prof_fork_parent(void);
+void prof_fork_child(void);
+int prof_dump(FILE *fp);
+#endif /* __PROF */
@@ -1,11 +1,8 @@
-#include "rbtree.h"
+#ifndef XALLOC_TLSF
 #include <assert.h>
 #include <errno.h>
-#include <stdbool.h>
-#include <string.h>
+#include "freelist.h"
 
-static bool resize_tab_values(metadata_t **old, rbnode_t *node);
-static rbnode_t *new_rbtree(metadata_t *node);
 static rbnode_t *remove_node(rbnode_t *node, t_key key, rbnode_t *tmp);
 
 static inline void flip_color(rbnode_t *node)
@@ -74,23 +71,33 @@ static rbnode_t *move_red_to_right(rbnode_t *node)
     return node;
 }
 
-static bool insert_node(rbnode_t *node, metadata_t *new)
+/* Chain @new right behind the block carrying the tree node, or in address
+ * order behind it for PLACE_ADDRESS.
+ */
+static void insert_node(rbnode_t *node, metadata_t *new)
 {
-    size_t i = 0;
-    metadata_t **tmp = node->tab_values;
-    size_t size = node->size_tab;
-    if (node->n_active == size) {
-        i = node->n_active;
-        if (!resize_tab_values(tmp, node))
-            return false;
-    } else {
-        while (i < size && tmp[i])
-            i++;
+    freelink_t *link = FREE_LINK(new);
+    metadata_t *prev = RB_META(node);
+    if (g_placement == PLACE_ADDRESS) {
+        while (FREE_LINK(prev)->next && FREE_LINK(prev)->next < new)
+            prev = FREE_LINK(prev)->next;
     }
+    link->prev = prev;
+    link->next = FREE_LINK(prev)->next;
+    if (link->next)
+        FREE_LINK(link->next)->prev = new;
+    FREE_LINK(prev)->next = new;
     node->n_active++;
-    ;
-    node->tab_values[i] = new;
-    return true;
+}
+
+static rbnode_t *new_rbtree(metadata_t *node)
+{
+    rbnode_t *new = RB_NODE(node);
+    new->link.next = new->link.prev = NULL;
+    new->n_active = 1;
+    new->color = RED;
+    new->left = new->right = NULL;
+    return new;
 }
 
 static rbnode_t *insert_this(rbnode_t *node, metadata_t *new)
@@ -98,11 +105,10 @@ static rbnode_t *insert_this(rbnode_t *node, metadata_t *new)
     if (!node)
         return new_rbtree(new);
 
-    int res = MY_COMPARE(new->size, node->key);
-    if (res == 0) {
-        if (!insert_node(node, new))
-            return NULL;
-    } else if (res < 0)
+    int res = MY_COMPARE(new->size, RB_KEY(node));
+    if (res == 0)
+        insert_node(node, new);
+    else if (res < 0)
         node->left = insert_this(node->left, new);
     else
         node->right = insert_this(node->right, new);
@@ -115,64 +121,20 @@ static rbnode_t *insert_this(rbnode_t *node, metadata_t *new)
     return node;
 }
 
-rbnode_t *insert_in_freed_list(rbnode_t *node, metadata_t *new)
-{
-    node = insert_this(node, new);
-    if (node)
-        node->color = BLACK;
-    new->free = YFREE;
-    return node;
-}
-
-static rbnode_t g_rbnode_basis = {
-    0, YFREE, NULL, NULL, 0, NULL, SIZE_TAB_VALUES, 1, RED, NULL, NULL,
-};
-
-static void *alloc_tab(size_t size)
-{
-    void *new;
-    size_t true_size = ALIGN_BYTES(META_SIZE + (sizeof(new) * size));
-    new = get_heap(true_size);
-    if (new)
-        memset(GET_PAYLOAD(new), 0, true_size - META_SIZE);
-    return new;
-}
-
-static rbnode_t *new_rbtree(metadata_t *node)
-{
-    rbnode_t *new;
-    if (!(new = get_heap(ALIGN_BYTES(sizeof(*new)))))
-        return NULL;
-    memcpy(&(new->size_tab), &(g_rbnode_basis.size_tab), sizeof(size_t) * 5);
-    new->key = node->size;
-    if ((new->tab_values = GET_PAYLOAD(alloc_tab(SIZE_TAB_VALUES))) ==
-        (void *) META_SIZE)
-        return NULL;
-    new->tab_values[0] = node;
-    return new;
-}
-
-static bool resize_tab_values(metadata_t **old, rbnode_t *node)
+void insert_in_freed_list(free_index_t *index, metadata_t *new)
 {
-    metadata_t **new;
-    size_t size = (node->size_tab) << 1;
-    if ((new = GET_PAYLOAD(alloc_tab(size))) == (void *) META_SIZE)
-        return false;
-    memcpy(new, old, (size >> 1) * sizeof(*new));
-    ((metadata_t *) GET_NODE(node->tab_values))->free = YFREE;
-    node->tab_values = new;
-    node->size_tab = size;
-    return true;
+    index->root = insert_this(index->root, new);
+    index->root->color = BLACK;
+    index->recent = new;
+    mark_free(new);
 }
 
 static rbnode_t *remove_min(rbnode_t *node)
 {
     if (!node)
         return NULL;
-    if (!node->left) {
-        node->meta.free = YFREE;
+    if (!node->left)
         return NULL;
-    }
     if (!IS_RED(node->left) && !IS_RED(node->left->left))
         node = move_red_to_left(node);
     node->left = remove_min(node->left);
@@ -195,7 +157,7 @@ static rbnode_t *remove_key(rbnode_t *node, t_key key)
         return NULL;
 
     rbnode_t *tmp = NULL;
-    if (MY_COMPARE(key, node->key) == -1) {
+    if (MY_COMPARE(key, RB_KEY(node)) == -1) {
         if (node->left) {
             if (!IS_RED(node->left) && !IS_RED(node->left->left))
                 node = move_red_to_left(node);
@@ -210,20 +172,18 @@ static rbnode_t *remove_node(rbnode_t *node, t_key key, rbnode_t *tmp)
 {
     if (IS_RED(node->left))
         node = rotate_right(node);
-    if (!MY_COMPARE(key, node->key) && !node->right) {
-        node->meta.free = YFREE;
+    if (!MY_COMPARE(key, RB_KEY(node)) && !node->right)
         return NULL;
-    }
     if (node->right) {
         if (!IS_RED(node->right) && !IS_RED(node->right->left))
             node = move_red_to_right(node);
-        if (!MY_COMPARE(key, node->key)) {
+        if (!MY_COMPARE(key, RB_KEY(node))) {
+            /* the successor takes the removed node's place in the tree */
             tmp = min(node->right);
-            node->tab_values = tmp->tab_values;
-            node->size_tab = tmp->size_tab;
-            node->key = tmp->key;
-            node->right = remove_min(node->right);
-            node->n_active = tmp->n_active;
+            tmp->right = remove_min(node->right);
+            tmp->left = node->left;
+            tmp->color = node->color;
+            node = tmp;
         } else
             node->right = remove_key(node->right, key);
     }
@@ -242,29 +202,101 @@ static rbnode_t *get_key(rbnode_t *node, t_key key)
 {
     while (node) {
         int cmp;
-        if (!(cmp = MY_COMPARE(key, node->key)))
+        if (!(cmp = MY_COMPARE(key, RB_KEY(node))))
             return (node);
         node = ((cmp < 0) ? node->left : node->right);
     }
     return NULL;
 }
 
-rbnode_t *remove_from_freed_list(rbnode_t *node, metadata_t *meta)
+/* Hand the tree node of @old over to @new, the next block of the same
+ * size, by rewriting the link that points at @old.
+ */
+static rbnode_t *replace_node(rbnode_t *root, rbnode_t *old, rbnode_t *new)
+{
+    rbnode_t **link = &root;
+    while (*link != old)
+        link = (RB_KEY(old) < RB_KEY(*link)) ? &(*link)->left : &(*link)->right;
+    new->link.prev = NULL;
+    new->n_active = old->n_active;
+    new->color = old->color;
+    new->left = old->left;
+    new->right = old->right;
+    *link = new;
+    return root;
+}
+
+void remove_from_freed_list(free_index_t *index, metadata_t *meta)
 {
     rbnode_t *tmp;
-    if ((tmp = get_key(node, meta->size))) {
-        meta->free = NFREE;
-        metadata_t **tab = tmp->tab_values;
-        size_t size = tmp->size_tab;
-        for (size_t i = 0; i < size; i++) {
-            if (tab[i] == meta) {
-                tab[i] = NULL;
-                tmp->n_active--;
-                if (tmp->n_active == 0)
-                    return remove_k(node, meta->size);
-                return node;
-            }
-        }
+    if (!(tmp = get_key(index->root, meta->size)))
+        return;
+
+    freelink_t *link = FREE_LINK(meta);
+    mark_used(meta);
+    if (index->recent == meta)
+        index->recent = NULL;
+    if (--tmp->n_active == 0) {
+        index->root = remove_k(index->root, meta->size);
+        return;
     }
-    return NULL;
-}
\ No newline at end of file
+    if (link->next)
+        FREE_LINK(link->next)->prev = link->prev;
+    if (link->prev)
+        FREE_LINK(link->prev)->next = link->next;
+    else
+        index->root = replace_node(index->root, tmp, RB_NODE(link->next));
+}
+
+static inline rbnode_t *find_best(rbnode_t *node, size_t size)
+{
+    rbnode_t *tmp = NULL;
+    while (node) {
+        if (RB_KEY(node) >= size) {
+            tmp = node;
+            node = node->left;
+        } else
+            node = node->right;
+    }
+    return tmp;
+}
+
+metadata_t *search_freed_block(const free_index_t *index, size_t size)
+{
+    if (g_placement == PLACE_LIFO && index->recent &&
+        index->recent->size >= size)
+        return index->recent;
+    rbnode_t *tmp = find_best(index->root, size);
+    if (!tmp)
+        return NULL;
+    metadata_t *next = tmp->link.next;
+    /* the carrier of the tree node is anywhere, the rest in order */
+    if (g_placement == PLACE_ADDRESS)
+        return (next && next < RB_META(tmp)) ? next : RB_META(tmp);
+    /* leave the block carrying the tree node for last */
+    return next ? next : RB_META(tmp);
+}
+
+static size_t tree_depth(rbnode_t *node)
+{
+    if (!node)
+        return 0;
+    size_t left = tree_depth(node->left);
+    size_t right = tree_depth(node->right);
+    return 1 + (left > right ? left : right);
+}
+
+static size_t tree_nodes(rbnode_t *node)
+{
+    if (!node)
+        return 0;
+    return 1 + tree_nodes(node->left) + tree_nodes(node->right);
+}
+
+void freed_list_shape(const free_index_t *index, size_t *nodes,
+                      size_t *depth)
+{
+    *nodes = tree_nodes(index->root);
+    *depth = tree_depth(index->root);
+}
+#endif /* XALLOC_TLSF */
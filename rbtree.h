@@ -1,9 +1,6 @@
 #ifndef __RBBTREE
 #define __RBBTREE
-#include <stddef.h>
-#include "heap.h"
-
-#define IS_FREE(x) ((x) ? (((metadata_t *) x)->free == YFREE) : (0))
+/* Included through freelist.h. */
 #define IS_RED(x) ((x) ? (((rbnode_t *) x)->color == RED) : (0))
 #define MY_COMPARE(k1, k2) (((k1 == k2) ? (0) : ((k1 < k2) ? (-1) : (1))))
 
@@ -12,19 +9,25 @@ typedef enum rbcolor { BLACK = 0, RED = 1 } rbcolor_t;
 typedef size_t t_key;
 typedef metadata_t t_value;
 
+/* The first free block of each size also carries the tree node. */
 typedef struct rbnode {
-    metadata_t meta;
-    size_t key;
-    t_value **tab_values;
-    size_t size_tab;
-    size_t n_active;
+    freelink_t link;
+    uint32_t n_active;
     rbcolor_t color;
     struct rbnode *left, *right;
 } rbnode_t;
 
-extern const char *__progname;
+#define RB_NODE(x) ((rbnode_t *) GET_PAYLOAD(x))
+#define RB_META(x) ((metadata_t *) GET_NODE(x))
+#define RB_KEY(x) (RB_META(x)->size)
+
+/* The last word of a free block holds its size for the boundary tag. */
+_Static_assert(sizeof(rbnode_t) + sizeof(size_t) <= SIZE_DEFAULT_BLOCK,
+               "a free block must be able to hold a tree node");
 
-rbnode_t *remove_from_freed_list(rbnode_t *node, metadata_t *meta);
-rbnode_t *insert_in_freed_list(rbnode_t *node, metadata_t *new);
+typedef struct free_index {
+    rbnode_t *root;
+    metadata_t *recent; /* the block inserted last, while still free */
+} free_index_t;
 
 #endif /* __RBBTREE */
\ No newline at end of file
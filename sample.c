@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include "sample.h"
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "clock.h"
+
+/* Frames of the allocator itself that may sit above its caller. */
+#define SAMPLE_SKIP (8)
+#define STACK_SLOTS (2 * SAMPLE_STACKS)
+#define LIVE_SLOTS (2 * SAMPLE_LIVE)
+
+typedef struct {
+    uint64_t hash;
+    size_t depth;
+    void *pcs[SAMPLE_DEPTH];
+} sample_stack_t;
+
+typedef struct {
+    size_t live_count, live_bytes;
+    size_t alloc_count, alloc_bytes;
+} sample_counts_t;
+
+typedef struct {
+    uintptr_t ptr;
+    size_t size;
+    size_t stack;
+} sample_live_t;
+
+bool g_sample_enabled;
+static char g_sample_path[4096];
+static size_t g_sample_rate = SAMPLE_RATE_DEFAULT;
+static pthread_mutex_t g_sample_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sample_stack_t *g_stacks; /* only ever added to */
+static sample_counts_t *g_counts;
+static uint32_t *g_stack_slots; /* index + 1 of a stack, 0 when empty */
+static size_t g_nstacks;
+static sample_live_t *g_live; /* open addressing, by address */
+static size_t g_nlive;
+static pthread_mutex_t g_dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sample_counts_t *g_dump;
+
+static __thread uint64_t t_seed;
+static __thread bool t_busy;
+
+/* The tables are mapped at once, and only touched as they fill; sampling
+ * starts from sample_start().
+ */
+void sample_init(void)
+{
+    const char *path = getenv("XALLOC_HEAPPROF");
+    size_t length = SAMPLE_STACKS * (sizeof(sample_stack_t) +
+                                     2 * sizeof(sample_counts_t)) +
+                    LIVE_SLOTS * sizeof(sample_live_t) +
+                    STACK_SLOTS * sizeof(uint32_t);
+
+    if (!path || !*path || strlen(path) >= sizeof(g_sample_path))
+        return;
+    strcpy(g_sample_path, path);
+    if ((path = getenv("XALLOC_HEAPPROF_RATE")) && atol(path) > 0)
+        g_sample_rate = atol(path);
+    if (g_sample_rate > PTRDIFF_MAX / 64)
+        g_sample_rate = PTRDIFF_MAX / 64;
+    char *map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return;
+    g_stacks = (sample_stack_t *) map;
+    g_counts = (sample_counts_t *) (g_stacks + SAMPLE_STACKS);
+    g_dump = g_counts + SAMPLE_STACKS;
+    g_live = (sample_live_t *) (g_dump + SAMPLE_STACKS);
+    g_stack_slots = (uint32_t *) (g_live + LIVE_SLOTS);
+}
+
+/* backtrace() loads its unwinder with dlopen() the first time it runs,
+ * which must not happen under a dlopen() that allocates: it runs once
+ * here, at load time, before the first sample.
+ */
+__attribute__((constructor)) static void sample_start(void)
+{
+    void *pc;
+    void *volatile ptr = malloc(1); /* runs sample_init() */
+
+    free(ptr);
+    if (!g_stacks)
+        return;
+    t_busy = true;
+    backtrace(&pc, 1);
+    t_busy = false;
+    g_sample_enabled = true;
+}
+
+/* xorshift64*, seeded per thread. */
+static uint64_t next_random(void)
+{
+    if (!t_seed)
+        t_seed = ((uintptr_t) &t_seed ^ clock_ns()) | 1;
+    t_seed ^= t_seed >> 12;
+    t_seed ^= t_seed << 25;
+    t_seed ^= t_seed >> 27;
+    return t_seed * 0x2545F4914F6CDD1DULL;
+}
+
+/* log2(@x) for @x > 0, within a hundredth: exact at powers of two and
+ * quadratic in between. Spares linking with libm.
+ */
+static double fast_log2(double x)
+{
+    union {
+        double d;
+        uint64_t u;
+    } v = {.d = x};
+    int exp = (int) ((v.u >> 52) & 0x7FF) - 1023;
+
+    v.u = (v.u & ((1ULL << 52) - 1)) | (1023ULL << 52);
+    return exp + (-1.0 / 3 * v.d + 2) * v.d - 5.0 / 3;
+}
+
+/* Bytes to allocate before the next sample, PTRDIFF_MAX when off. */
+ptrdiff_t sample_interval(void)
+{
+    if (!g_sample_enabled)
+        return g_stacks ? (ptrdiff_t) g_sample_rate : PTRDIFF_MAX;
+    /* u is uniform in (0, 1] and -ln(u) exponential of mean 1 */
+    double u = ((next_random() >> 11) + 1) * 0x1p-53;
+    return (ptrdiff_t) (-fast_log2(u) * M_LN2 * g_sample_rate) + 1;
+}
+
+static uint64_t hash_stack(void **pcs, size_t depth)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < depth; i++)
+        hash = (hash ^ (uintptr_t) pcs[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+/* The index of the stack, added if new; SAMPLE_STACKS once full. */
+static size_t find_stack(void **pcs, size_t depth)
+{
+    uint64_t hash = hash_stack(pcs, depth);
+    size_t mask = STACK_SLOTS - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (!g_stack_slots[i]) {
+            if (g_nstacks == SAMPLE_STACKS)
+                return SAMPLE_STACKS;
+            sample_stack_t *stack = &g_stacks[g_nstacks];
+            stack->hash = hash;
+            stack->depth = depth;
+            memcpy(stack->pcs, pcs, depth * sizeof(*pcs));
+            g_stack_slots[i] = ++g_nstacks;
+            return g_nstacks - 1;
+        }
+        sample_stack_t *stack = &g_stacks[g_stack_slots[i] - 1];
+        if (stack->hash == hash && stack->depth == depth &&
+            !memcmp(stack->pcs, pcs, depth * sizeof(*pcs)))
+            return g_stack_slots[i] - 1;
+    }
+}
+
+static inline size_t live_home(uintptr_t ptr)
+{
+    return (ptr * 0x9E3779B97F4A7C15ULL >> 32) & (LIVE_SLOTS - 1);
+}
+
+/* The entry of @ptr, or the empty slot it would take. */
+static sample_live_t *live_slot(uintptr_t ptr)
+{
+    for (size_t i = live_home(ptr);; i = (i + 1) & (LIVE_SLOTS - 1)) {
+        if (g_live[i].ptr == ptr || !g_live[i].ptr)
+            return &g_live[i];
+    }
+}
+
+/* Blocks come and go for as long as the process runs: rather than leave a
+ * tombstone, the entries that probed past @e move back over it.
+ */
+static void live_erase(sample_live_t *e)
+{
+    size_t i = e - g_live, mask = LIVE_SLOTS - 1;
+    sample_counts_t *counts = &g_counts[e->stack];
+
+    counts->live_count--;
+    counts->live_bytes -= e->size;
+    g_nlive--;
+    for (size_t j = (i + 1) & mask; g_live[j].ptr; j = (j + 1) & mask) {
+        size_t home = live_home(g_live[j].ptr);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            g_live[i] = g_live[j];
+            i = j;
+        }
+    }
+    g_live[i].ptr = 0;
+}
+
+static void live_insert(uintptr_t ptr, size_t size, size_t stack)
+{
+    sample_live_t *e = live_slot(ptr);
+
+    /* a block that went away unnoticed */
+    if (e->ptr) {
+        live_erase(e);
+        e = live_slot(ptr);
+    }
+    if (g_nlive == SAMPLE_LIVE)
+        return;
+    *e = (sample_live_t){.ptr = ptr, .size = size, .stack = stack};
+    g_nlive++;
+    g_counts[stack].live_count++;
+    g_counts[stack].live_bytes += size;
+}
+
+/* The stack is taken before the mutex: backtrace() allocates the first
+ * time it runs, and an allocation it makes is never sampled. It is cut
+ * above @caller, whatever the allocator inlined on the way; all of it but
+ * this frame is kept should @caller not be found.
+ */
+void sample_record(void *ptr, size_t size, void *caller)
+{
+    void *pcs[SAMPLE_DEPTH + SAMPLE_SKIP];
+    int first = 0;
+
+    if (t_busy)
+        return;
+    t_busy = true;
+    int depth = backtrace(pcs, SAMPLE_DEPTH + SAMPLE_SKIP);
+    t_busy = false;
+    while (first < depth && first < SAMPLE_SKIP && pcs[first] != caller)
+        first++;
+    if (first == depth || first == SAMPLE_SKIP)
+        first = depth > 0;
+    depth -= first;
+    if (depth > SAMPLE_DEPTH)
+        depth = SAMPLE_DEPTH;
+
+    pthread_mutex_lock(&g_sample_mutex);
+    size_t stack = find_stack(pcs + first, depth);
+    if (stack < SAMPLE_STACKS) {
+        g_counts[stack].alloc_count++;
+        g_counts[stack].alloc_bytes += size;
+        live_insert((uintptr_t) ptr, size, stack);
+    }
+    pthread_mutex_unlock(&g_sample_mutex);
+}
+
+void sample_forget(void *ptr)
+{
+    pthread_mutex_lock(&g_sample_mutex);
+    sample_live_t *e = live_slot((uintptr_t) ptr);
+    if (e->ptr)
+        live_erase(e);
+    pthread_mutex_unlock(&g_sample_mutex);
+}
+
+/* A block resized by realloc, in place or not, keeps its sample at its
+ * new address and size.
+ */
+void sample_resize(void *old, void *ptr, size_t size)
+{
+    pthread_mutex_lock(&g_sample_mutex);
+    sample_live_t *e = live_slot((uintptr_t) old);
+    if (e->ptr) {
+        size_t stack = e->stack;
+        live_erase(e);
+        live_insert((uintptr_t) ptr, size, stack);
+    }
+    pthread_mutex_unlock(&g_sample_mutex);
+}
+
+/* As g_prof_mutex in prof.c: g_sample_mutex is never held while waiting
+ * for another lock, and the child starts g_dump_mutex over.
+ */
+void sample_fork_prepare(void)
+{
+    pthread_mutex_lock(&g_sample_mutex);
+}
+
+void sample_fork_parent(void)
+{
+    pthread_mutex_unlock(&g_sample_mutex);
+}
+
+void sample_fork_child(void)
+{
+    pthread_mutex_init(&g_sample_mutex, NULL);
+    pthread_mutex_init(&g_dump_mutex, NULL);
+}
+
+/* pprof resolves the addresses against the mappings that follow them. */
+static void copy_maps(FILE *fp)
+{
+    char buf[4096];
+    ssize_t len;
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return;
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, len, fp);
+    close(fd);
+}
+
+/* Print one line per call stack, in the legacy pprof heap format: the
+ * sampled blocks it holds and their bytes, then those it ever allocated.
+ * pprof scales the samples back by the rate in the header. Returns -1
+ * when the profiler is off.
+ */
+int sample_dump(FILE *fp)
+{
+    sample_counts_t total = {0};
+
+    if (!g_sample_enabled)
+        return -1;
+
+    /* stacks below g_nstacks never change: only the counts are copied */
+    pthread_mutex_lock(&g_dump_mutex);
+    pthread_mutex_lock(&g_sample_mutex);
+    size_t n = g_nstacks;
+    memcpy(g_dump, g_counts, n * sizeof(*g_dump));
+    pthread_mutex_unlock(&g_sample_mutex);
+
+    for (size_t i = 0; i < n; i++) {
+        total.live_count += g_dump[i].live_count;
+        total.live_bytes += g_dump[i].live_bytes;
+        total.alloc_count += g_dump[i].alloc_count;
+        total.alloc_bytes += g_dump[i].alloc_bytes;
+    }
+    fprintf(fp, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            total.live_count, total.live_bytes, total.alloc_count,
+            total.alloc_bytes, g_sample_rate);
+    for (size_t i = 0; i < n; i++) {
+        fprintf(fp, "%zu: %zu [%zu: %zu] @", g_dump[i].live_count,
+                g_dump[i].live_bytes, g_dump[i].alloc_count,
+                g_dump[i].alloc_bytes);
+        for (size_t j = 0; j < g_stacks[i].depth; j++)
+            fprintf(fp, " %p", g_stacks[i].pcs[j]);
+        fputc('\n', fp);
+    }
+    fputs("\nMAPPED_LIBRARIES:\n", fp);
+    copy_maps(fp);
+    pthread_mutex_unlock(&g_dump_mutex);
+    return 0;
+}
+
+__attribute__((destructor)) static void sample_exit(void)
+{
+    char name[sizeof(g_sample_path) + 16];
+
+    if (!g_sample_enabled)
+        return;
+    snprintf(name, sizeof(name), "%s.%d", g_sample_path, (int) getpid());
+    FILE *fp = fopen(name, "w");
+    if (fp) {
+        sample_dump(fp);
+        fclose(fp);
+    }
+}
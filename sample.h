@@ -0,0 +1,36 @@
+#ifndef __SAMPLE
+#define __SAMPLE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* With XALLOC_HEAPPROF=path in the environment, about one allocation per
+ * XALLOC_HEAPPROF_RATE bytes (SAMPLE_RATE_DEFAULT) is sampled: the gaps
+ * between samples are drawn from an exponential distribution, so that a
+ * block of n bytes is sampled with probability 1 - exp(-n / rate). The
+ * call stack, size and address of a sampled block are kept until it is
+ * freed. The live and cumulative profiles are written in the legacy pprof
+ * heap format to path.<pid> at exit, or on demand through
+ * malloc_heap_dump().
+ */
+#define SAMPLE_RATE_DEFAULT (512 * 1024)
+#define SAMPLE_DEPTH (32)
+
+/* Distinct call stacks, and sampled blocks live at once. */
+#define SAMPLE_STACKS (1 << 16)
+#define SAMPLE_LIVE (1 << 18)
+
+extern bool g_sample_enabled;
+
+#define SAMPLING() __builtin_expect(g_sample_enabled, 0)
+
+void sample_init(void);
+ptrdiff_t sample_interval(void);
+void sample_record(void *ptr, size_t size, void *caller);
+void sample_forget(void *ptr);
+void sample_resize(void *old, void *ptr, size_t size);
+int sample_dump(FILE *fp);
+void sample_fork_prepare(void);
+void sample_fork_parent(void);
+void sample_fork_child(void);
+#endif /* __SAMPLE */
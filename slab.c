@@ -0,0 +1,229 @@
+#include "slab.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+static char *g_region = NULL;
+static char *g_region_top = NULL;
+static slab_run_t *g_free_runs = NULL;
+static pthread_mutex_t g_region_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void slab_init(void)
+{
+    void *base = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    STATS_ADD(mmaps, 1);
+    if (base == MAP_FAILED)
+        return;
+    g_region = g_region_top = base;
+}
+
+int slab_owns(void *ptr)
+{
+    return (char *) ptr >= g_region && (char *) ptr < g_region_top;
+}
+
+static inline void *object_at(slab_run_t *run, size_t i)
+{
+    return (char *) run + SLAB_RUN_HEADER + i * run->size;
+}
+
+static inline size_t object_index(slab_run_t *run, void *ptr)
+{
+    return ((char *) ptr - (char *) run - SLAB_RUN_HEADER) / run->size;
+}
+
+int is_invalid_slab_pointer(void *ptr)
+{
+    slab_run_t *run = SLAB_RUN_OF(ptr);
+    size_t offset = (char *) ptr - (char *) run;
+    return !run->size || offset < SLAB_RUN_HEADER ||
+           (offset - SLAB_RUN_HEADER) % run->size ||
+           object_index(run, ptr) >= run->n_objects;
+}
+
+/* g_region_mutex is taken under an arena's: after all of them before
+ * fork().
+ */
+void slab_fork_prepare(void)
+{
+    pthread_mutex_lock(&g_region_mutex);
+}
+
+void slab_fork_parent(void)
+{
+    pthread_mutex_unlock(&g_region_mutex);
+}
+
+void slab_fork_child(void)
+{
+    pthread_mutex_init(&g_region_mutex, NULL);
+}
+
+static slab_run_t *new_run(uint32_t arena, size_t size)
+{
+    slab_run_t *run = NULL;
+
+    pthread_mutex_lock(&g_region_mutex);
+    if (g_free_runs) {
+        run = g_free_runs;
+        g_free_runs = run->next;
+    } else if (g_region &&
+               g_region_top + SLAB_RUN_SIZE <= g_region + SLAB_REGION_SIZE) {
+        run = (slab_run_t *) g_region_top;
+        run->dirty = 0;
+        g_region_top += SLAB_RUN_SIZE;
+    }
+    pthread_mutex_unlock(&g_region_mutex);
+    if (!run)
+        return NULL;
+
+    run->next = run->prev = NULL;
+    run->size = size;
+    run->n_objects = (SLAB_RUN_SIZE - SLAB_RUN_HEADER) / size;
+    run->n_free = run->n_objects;
+    run->arena = arena;
+    for (size_t i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        size_t bits = run->n_objects > i * 64 ? run->n_objects - i * 64 : 0;
+        run->bitmap[i] = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+    }
+    return run;
+}
+
+/* A released run keeps no header contents but its dirty mark: zero once the
+ * kernel took the pages back, all of the run if madvise() refused.
+ */
+static void release_run(slab_run_t *run)
+{
+    int dropped = !madvise(run, SLAB_RUN_SIZE, MADV_DONTNEED);
+    STATS_ADD(madvises, 1);
+    run->size = 0;
+    run->dirty = dropped ? 0 : UINT32_MAX;
+    pthread_mutex_lock(&g_region_mutex);
+    run->next = g_free_runs;
+    g_free_runs = run;
+    pthread_mutex_unlock(&g_region_mutex);
+}
+
+static inline void unlink_run(slab_run_t **head, slab_run_t *run)
+{
+    if (run->prev)
+        run->prev->next = run->next;
+    else
+        *head = run->next;
+    if (run->next)
+        run->next->prev = run->prev;
+    run->next = run->prev = NULL;
+}
+
+static inline void push_run(slab_run_t **head, slab_run_t *run)
+{
+    run->prev = NULL;
+    run->next = *head;
+    if (*head)
+        (*head)->prev = run;
+    *head = run;
+}
+
+/* Called with the arena's mutex held. Objects past the run's dirty mark
+ * have not been handed out since the run was mapped or madvised.
+ */
+void *slab_alloc(slab_t *slab, uint32_t arena, size_t size, int *zeroed)
+{
+    slab_run_t **head = &slab->partial[SLAB_CLASS(size)];
+    slab_run_t *run = *head;
+
+    if (!run) {
+        if (!(run = new_run(arena, SLAB_SIZE(size))))
+            return NULL;
+        push_run(head, run);
+    }
+    for (size_t i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        if (run->bitmap[i]) {
+            size_t index = i * 64 + __builtin_ctzll(run->bitmap[i]);
+            run->bitmap[i] &= run->bitmap[i] - 1;
+            if (!--run->n_free)
+                unlink_run(head, run);
+            *zeroed = index >= run->dirty;
+            if (*zeroed)
+                run->dirty = index + 1;
+            return object_at(run, index);
+        }
+    }
+    return NULL;
+}
+
+/* Called with the mutex of the arena owning the run held; returns -1 if the
+ * object is already free.
+ */
+int slab_free(slab_t *slab, void *ptr)
+{
+    slab_run_t *run = SLAB_RUN_OF(ptr);
+    slab_run_t **head = &slab->partial[SLAB_CLASS(run->size)];
+    size_t i = object_index(run, ptr);
+
+    if ((run->bitmap[i / 64] >> (i % 64)) & 1)
+        return -1;
+    run->bitmap[i / 64] |= 1ULL << (i % 64);
+    if (!run->n_free++)
+        push_run(head, run);
+    else if (run->n_free == run->n_objects && *head != run) {
+        /* keep the head run warm, give other empty runs back */
+        unlink_run(head, run);
+        release_run(run);
+    }
+    return 0;
+}
+
+/* Called with every arena's mutex held, as runs change hands between them:
+ * account for the runs of @arena.
+ */
+void slab_collect(struct alloc_stats *st, uint32_t arena)
+{
+    pthread_mutex_lock(&g_region_mutex);
+    for (char *it = g_region; it < g_region_top; it += SLAB_RUN_SIZE) {
+        slab_run_t *run = (slab_run_t *) it;
+        if (!run->size || run->arena != arena)
+            continue;
+        size_t used = run->n_objects - run->n_free;
+        st->slab_runs++;
+        st->slab_objects += used;
+        st->slab_bytes += used * run->size;
+        st->used_hist[stats_bin(run->size)] += used;
+    }
+    pthread_mutex_unlock(&g_region_mutex);
+}
+
+/* Called with every arena's mutex held: report the runs of @arena and the
+ * objects they hand out.
+ */
+int slab_walk(uint32_t arena, int (*fn)(const struct malloc_walk *, void *),
+              void *arg)
+{
+    malloc_walk_t rec = {.arena = arena};
+    int ret = 0;
+
+    pthread_mutex_lock(&g_region_mutex);
+    for (char *it = g_region; it < g_region_top && !ret;
+         it += SLAB_RUN_SIZE) {
+        slab_run_t *run = (slab_run_t *) it;
+        if (!run->size || run->arena != arena)
+            continue;
+        rec.kind = MALLOC_WALK_SLAB_RUN;
+        rec.ptr = run;
+        rec.size = SLAB_RUN_SIZE;
+        rec.overhead = SLAB_RUN_SIZE - run->n_objects * run->size;
+        ret = fn(&rec, arg);
+        rec.kind = MALLOC_WALK_SLAB_OBJECT;
+        rec.size = run->size;
+        rec.overhead = 0;
+        for (size_t i = 0; i < run->n_objects && !ret; i++) {
+            if ((run->bitmap[i / 64] >> (i % 64)) & 1)
+                continue;
+            rec.ptr = object_at(run, i);
+            ret = fn(&rec, arg);
+        }
+    }
+    pthread_mutex_unlock(&g_region_mutex);
+    return ret;
+}
@@ -0,0 +1,53 @@
+#ifndef __SLAB
+#define __SLAB
+#include <stddef.h>
+#include <stdint.h>
+
+/* Requests up to SLAB_MAX_SIZE are served from page-sized runs of equally
+ * sized objects carved out of one reserved region. Objects carry no header:
+ * the run is found by masking the address.
+ */
+#define SLAB_MAX_SIZE (256)
+#define SLAB_QUANTUM (16)
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_QUANTUM)
+#define SLAB_CLASS(x) (((x) - 1) / SLAB_QUANTUM)
+#define SLAB_SIZE(x) ((SLAB_CLASS(x) + 1) * SLAB_QUANTUM)
+#define SLAB_RUN_SIZE (4096UL)
+#define SLAB_BITMAP_WORDS (4)
+#if __SIZE_WIDTH__ == 64
+#define SLAB_REGION_SIZE (1UL << 30)
+#else
+#define SLAB_REGION_SIZE (64UL << 20)
+#endif
+
+typedef struct slab_run {
+    struct slab_run *next, *prev;
+    uint32_t size;
+    uint32_t n_free;
+    uint32_t n_objects;
+    uint32_t arena;
+    uint32_t dirty;
+    uint64_t bitmap[SLAB_BITMAP_WORDS];
+} slab_run_t;
+
+#define SLAB_RUN_HEADER ((sizeof(slab_run_t) + 15) & ~15UL)
+#define SLAB_RUN_OF(x) ((slab_run_t *) ((uintptr_t) (x) & ~(SLAB_RUN_SIZE - 1)))
+
+typedef struct {
+    slab_run_t *partial[SLAB_CLASSES];
+} slab_t;
+
+void slab_init(void);
+int slab_owns(void *ptr);
+int is_invalid_slab_pointer(void *ptr);
+void *slab_alloc(slab_t *slab, uint32_t arena, size_t size, int *zeroed);
+int slab_free(slab_t *slab, void *ptr);
+void slab_fork_prepare(void);
+void slab_fork_parent(void);
+void slab_fork_child(void);
+struct alloc_stats;
+struct malloc_walk;
+void slab_collect(struct alloc_stats *st, uint32_t arena);
+int slab_walk(uint32_t arena, int (*fn)(const struct malloc_walk *, void *),
+              void *arg);
+#endif /* __SLAB */
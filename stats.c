@@ -0,0 +1,197 @@
+#include "stats.h"
+#include "slab.h"
+
+global_stats_t g_stats;
+
+/* Called with the arena's mutex held: walk every block of @heap. */
+void stats_collect(alloc_stats_t *st, heap_t *heap,
+                   const free_index_t *index)
+{
+    for (segment_t *seg = heap->segments; seg; seg = seg->next) {
+        void *top = seg->end_in_page + seg->page_remaining;
+        st->segments++;
+        st->committed += top - (void *) seg;
+        st->top_bytes += seg->page_remaining;
+        for (metadata_t *node = SEGMENT_FIRST(seg);
+             (void *) node < seg->end_in_page; node = NEXT_BLOCK(node)) {
+            size_t payload = node->size - META_SIZE;
+            if (node->free == YFREE) {
+                st->free_blocks++;
+                st->free_bytes += payload;
+                if (payload > st->largest_free)
+                    st->largest_free = payload;
+                st->free_hist[stats_bin(payload)]++;
+            } else if (node->free == CFREE) {
+                st->cached_blocks++;
+                st->cached_bytes += payload;
+            } else {
+                st->used_blocks++;
+                st->used_bytes += payload;
+                st->used_hist[stats_bin(payload)]++;
+            }
+        }
+    }
+    freed_list_shape(index, &st->tree_nodes, &st->tree_depth);
+    slab_collect(st, heap->arena);
+}
+
+/* Called with the arena's mutex held: report every block of @heap. */
+int stats_walk(heap_t *heap, malloc_walk_fn fn, void *arg)
+{
+    malloc_walk_t rec = {.arena = heap->arena};
+    int ret;
+
+    for (segment_t *seg = heap->segments; seg; seg = seg->next) {
+        void *top = seg->end_in_page + seg->page_remaining;
+        rec.kind = MALLOC_WALK_SEGMENT;
+        rec.ptr = seg;
+        rec.size = top - (void *) seg;
+        rec.overhead = SEGMENT_HEADER + META_SIZE;
+        if ((ret = fn(&rec, arg)))
+            return ret;
+        for (metadata_t *node = SEGMENT_FIRST(seg);
+             (void *) node < seg->end_in_page; node = NEXT_BLOCK(node)) {
+            if (node->free == YFREE)
+                rec.kind = MALLOC_WALK_FREE;
+            else if (node->free == CFREE)
+                rec.kind = MALLOC_WALK_CACHED;
+            else
+                rec.kind = MALLOC_WALK_USED;
+            rec.ptr = GET_PAYLOAD(node);
+            rec.size = node->size - META_SIZE;
+            rec.overhead = META_SIZE;
+            if ((ret = fn(&rec, arg)))
+                return ret;
+        }
+        rec.kind = MALLOC_WALK_TOP;
+        rec.ptr = seg->end_in_page;
+        rec.size = seg->page_remaining;
+        rec.overhead = 0;
+        if ((ret = fn(&rec, arg)))
+            return ret;
+    }
+    return slab_walk(heap->arena, fn, arg);
+}
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+void stats_merge(alloc_stats_t *total, const alloc_stats_t *st)
+{
+    size_t largest = MAX(total->largest_free, st->largest_free);
+    size_t depth = MAX(total->tree_depth, st->tree_depth);
+    size_t *dst = (size_t *) total;
+    const size_t *src = (const size_t *) st;
+
+    for (size_t i = 0; i < sizeof(*st) / sizeof(size_t); i++)
+        dst[i] += src[i];
+    total->largest_free = largest;
+    total->tree_depth = depth;
+}
+
+/* External fragmentation: the share of the free memory that cannot serve a
+ * request as large as the largest free block.
+ */
+static double fragmentation(const alloc_stats_t *st)
+{
+    if (!st->free_bytes)
+        return 0.0;
+    return 1.0 - (double) st->largest_free / st->free_bytes;
+}
+
+#define FIELDS(X)                                                         \
+    X(segments) X(committed) X(top_bytes) X(used_blocks) X(used_bytes)    \
+    X(free_blocks) X(free_bytes) X(largest_free) X(cached_blocks)         \
+    X(cached_bytes) X(tree_nodes) X(tree_depth) X(slab_runs)              \
+    X(slab_objects) X(slab_bytes)
+#define COUNTERS(X)                                                       \
+    X(mallocs) X(frees) X(splits) X(fusions) X(breaks) X(consolidations) \
+    X(remote_frees)
+#define GLOBALS(X)                                                        \
+    X(mmaps) X(munmaps) X(mremaps) X(madvises) X(mapped_blocks)           \
+    X(mapped_bytes)
+
+static void print_field(FILE *fp, bool json, const char **sep,
+                        const char *name, size_t value)
+{
+    if (json)
+        fprintf(fp, "%s\"%s\": %zu", *sep, name, value);
+    else
+        fprintf(fp, "  %-16s%zu\n", name, value);
+    *sep = ", ";
+}
+
+static void print_hist(FILE *fp, const char *name, const size_t *hist,
+                       bool json)
+{
+    if (json) {
+        fprintf(fp, ", \"%s\": [", name);
+        for (size_t i = 0; i < STATS_BINS; i++)
+            fprintf(fp, "%s%zu", i ? ", " : "", hist[i]);
+        fprintf(fp, "]");
+        return;
+    }
+    fprintf(fp, "  %s:\n", name);
+    for (size_t i = 0; i < STATS_BINS; i++) {
+        char range[48];
+        if (!hist[i])
+            continue;
+        snprintf(range, sizeof(range), "[%zu, %zu)",
+                 i ? (size_t) 16 << i : 0, (size_t) 32 << i);
+        fprintf(fp, "    %-24s%zu\n", range, hist[i]);
+    }
+}
+
+static void print_arena(FILE *fp, const alloc_stats_t *st, bool json)
+{
+    const char *sep = "";
+#define FIELD(x) print_field(fp, json, &sep, #x, st->x);
+#define COUNTER(x) print_field(fp, json, &sep, #x, st->counters.x);
+    if (json)
+        fprintf(fp, "{");
+    FIELDS(FIELD)
+    if (json)
+        fprintf(fp, ", \"fragmentation\": %.4f", fragmentation(st));
+    else
+        fprintf(fp, "  %-16s%.4f\n", "fragmentation", fragmentation(st));
+    COUNTERS(COUNTER)
+#undef FIELD
+#undef COUNTER
+    print_hist(fp, "used_hist", st->used_hist, json);
+    print_hist(fp, "free_hist", st->free_hist, json);
+    if (json)
+        fprintf(fp, "}");
+}
+
+/* Print the snapshots of @n arenas followed by their total and by the
+ * process-wide counters, as text or as one JSON object.
+ */
+void stats_print(FILE *fp, const alloc_stats_t *arenas, size_t n, bool json)
+{
+    alloc_stats_t total = {0};
+    global_stats_t global;
+    size_t *dst = (size_t *) &global;
+    size_t *src = (size_t *) &g_stats;
+    const char *sep = ", ";
+
+    for (size_t i = 0; i < sizeof(global) / sizeof(size_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    if (json)
+        fprintf(fp, "{\"arenas\": [");
+    for (size_t i = 0; i < n; i++) {
+        stats_merge(&total, &arenas[i]);
+        if (json)
+            fprintf(fp, "%s", i ? ", " : "");
+        else
+            fprintf(fp, "Arena %zu:\n", i);
+        print_arena(fp, &arenas[i], json);
+    }
+    fprintf(fp, json ? "], \"total\": " : "Total:\n");
+    print_arena(fp, &total, json);
+    if (!json)
+        fprintf(fp, "Process:\n");
+#define GLOBAL(x) print_field(fp, json, &sep, #x, global.x);
+    GLOBALS(GLOBAL)
+#undef GLOBAL
+    if (json)
+        fprintf(fp, "}\n");
+}
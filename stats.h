@@ -0,0 +1,97 @@
+#ifndef __STATS
+#define __STATS
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "freelist.h"
+
+/* Operation counters of an arena, updated under its mutex. The malloc and
+ * free calls served by a thread cache are counted in the thread and folded
+ * in the next time it holds its arena's mutex.
+ */
+typedef struct arena_stats {
+    size_t mallocs;
+    size_t frees;
+    size_t splits;
+    size_t fusions;
+    size_t breaks;
+    size_t consolidations;
+    size_t remote_frees;
+} arena_stats_t;
+
+/* Process-wide counters, only touched around system calls and updated with
+ * relaxed atomics.
+ */
+typedef struct global_stats {
+    size_t mmaps;
+    size_t munmaps;
+    size_t mremaps;
+    size_t madvises;
+    size_t mapped_blocks;
+    size_t mapped_bytes;
+} global_stats_t;
+
+extern global_stats_t g_stats;
+
+#define STATS_ADD(field, n) \
+    __atomic_fetch_add(&g_stats.field, (n), __ATOMIC_RELAXED)
+#define STATS_SUB(field, n) \
+    __atomic_fetch_sub(&g_stats.field, (n), __ATOMIC_RELAXED)
+
+/* Block sizes are binned by power of two: [0, 32), [32, 64) and up. */
+#define STATS_BINS (28)
+
+static inline size_t stats_bin(size_t size)
+{
+    size_t bin = 0;
+    for (size >>= 5; size && bin < STATS_BINS - 1; size >>= 1)
+        bin++;
+    return bin;
+}
+
+/* A snapshot of one arena, or of all of them, built by walking the heap. */
+typedef struct alloc_stats {
+    size_t segments;
+    size_t committed;
+    size_t top_bytes;
+    size_t used_blocks, used_bytes;
+    size_t free_blocks, free_bytes, largest_free;
+    size_t cached_blocks, cached_bytes;
+    size_t tree_nodes, tree_depth;
+    size_t slab_runs, slab_objects, slab_bytes;
+    size_t used_hist[STATS_BINS];
+    size_t free_hist[STATS_BINS];
+    arena_stats_t counters;
+} alloc_stats_t;
+
+/* What malloc_walk() reports. Each segment comes with its blocks in
+ * address order, then with the committed bytes past its last block.
+ */
+enum malloc_walk_kind {
+    MALLOC_WALK_SEGMENT,
+    MALLOC_WALK_USED,
+    MALLOC_WALK_FREE,   /* in the free index */
+    MALLOC_WALK_CACHED, /* parked in a thread cache or a quick list */
+    MALLOC_WALK_TOP,    /* past the fence, possibly empty */
+    MALLOC_WALK_SLAB_RUN,
+    MALLOC_WALK_SLAB_OBJECT, /* in use, or parked in a thread cache */
+};
+
+typedef struct malloc_walk {
+    int kind;
+    uint32_t arena;
+    void *ptr;       /* the payload, or the segment, fence or run */
+    size_t size;     /* usable bytes, or the bytes spanned */
+    size_t overhead; /* headers, fences and unusable tails */
+} malloc_walk_t;
+
+/* Returns nonzero to stop the walk. */
+typedef int (*malloc_walk_fn)(const malloc_walk_t *rec, void *arg);
+
+void stats_collect(alloc_stats_t *st, heap_t *heap,
+                   const free_index_t *index);
+int stats_walk(heap_t *heap, malloc_walk_fn fn, void *arg);
+void stats_merge(alloc_stats_t *total, const alloc_stats_t *st);
+void stats_print(FILE *fp, const alloc_stats_t *arenas, size_t n, bool json);
+#endif /* __STATS */
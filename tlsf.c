@@ -0,0 +1,107 @@
+#ifdef XALLOC_TLSF
+#include "freelist.h"
+#include "bits.h"
+
+static inline void mapping(size_t size, size_t *fl, size_t *sl)
+{
+    if (size < TLSF_SMALL) {
+        *fl = 0;
+        *sl = size >> TLSF_ALIGN_SHIFT;
+    } else {
+        size_t t = msb(size);
+        *sl = (size >> (t - TLSF_SL_SHIFT)) ^ TLSF_SL_COUNT;
+        *fl = t - TLSF_FL_SHIFT + 1;
+    }
+}
+
+/* Freed blocks go to the head of their class, or in address order for
+ * PLACE_ADDRESS.
+ */
+void insert_in_freed_list(free_index_t *index, metadata_t *new)
+{
+    freelink_t *link = FREE_LINK(new);
+    metadata_t *prev = NULL;
+    size_t fl, sl;
+
+    mapping(new->size, &fl, &sl);
+    if (g_placement == PLACE_ADDRESS) {
+        metadata_t *next = index->heads[fl][sl];
+        for (; next && next < new; next = FREE_LINK(next)->next)
+            prev = next;
+    }
+    link->prev = prev;
+    link->next = prev ? FREE_LINK(prev)->next : index->heads[fl][sl];
+    if (link->next)
+        FREE_LINK(link->next)->prev = new;
+    if (prev)
+        FREE_LINK(prev)->next = new;
+    else
+        index->heads[fl][sl] = new;
+    index->fl_bitmap |= (size_t) 1 << fl;
+    index->sl_bitmap[fl] |= 1U << sl;
+    index->recent = new;
+    mark_free(new);
+}
+
+void remove_from_freed_list(free_index_t *index, metadata_t *meta)
+{
+    freelink_t *link = FREE_LINK(meta);
+    size_t fl, sl;
+
+    mapping(meta->size, &fl, &sl);
+    mark_used(meta);
+    if (index->recent == meta)
+        index->recent = NULL;
+    if (link->next)
+        FREE_LINK(link->next)->prev = link->prev;
+    if (link->prev)
+        FREE_LINK(link->prev)->next = link->next;
+    else if (!(index->heads[fl][sl] = link->next)) {
+        index->sl_bitmap[fl] &= ~(1U << sl);
+        if (!index->sl_bitmap[fl])
+            index->fl_bitmap &= ~((size_t) 1 << fl);
+    }
+}
+
+/* Good fit: the head of the class of @size is taken when it is large
+ * enough, otherwise the first block of the next non-empty class, where
+ * every block fits.
+ */
+metadata_t *search_freed_block(const free_index_t *index, size_t size)
+{
+    size_t fl, sl;
+
+    if (g_placement == PLACE_LIFO && index->recent &&
+        index->recent->size >= size)
+        return index->recent;
+    mapping(size, &fl, &sl);
+    metadata_t *head = index->heads[fl][sl];
+    if (head && head->size >= size)
+        return head;
+    if (++sl == TLSF_SL_COUNT) {
+        sl = 0;
+        fl++;
+    }
+    if (fl >= TLSF_FL_COUNT)
+        return NULL;
+    uint32_t sl_map = index->sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        size_t fl_map = index->fl_bitmap & (~(size_t) 0 << fl << 1);
+        if (!fl_map)
+            return NULL;
+        fl = __builtin_ctzll(fl_map);
+        sl_map = index->sl_bitmap[fl];
+    }
+    return index->heads[fl][__builtin_ctz(sl_map)];
+}
+
+/* The index is flat: report its non-empty classes and two levels. */
+void freed_list_shape(const free_index_t *index, size_t *nodes,
+                      size_t *depth)
+{
+    *nodes = 0;
+    for (size_t fl = 0; fl < TLSF_FL_COUNT; fl++)
+        *nodes += __builtin_popcount(index->sl_bitmap[fl]);
+    *depth = *nodes ? 2 : 0;
+}
+#endif /* XALLOC_TLSF */
@@ -0,0 +1,32 @@
+#ifndef __TLSF
+#define __TLSF
+/* Included through freelist.h. */
+
+/* Two-level segregated fit: the first level splits block sizes by power of
+ * two, the second splits each power of two into TLSF_SL_COUNT classes, and
+ * every class keeps a list of its free blocks. Sizes below TLSF_SMALL get a
+ * class per ALIGN_BYTES(1) step. One bit per non-empty class and one per
+ * first level with any of them make every lookup a few bit scans.
+ */
+#if __SIZE_WIDTH__ == 64
+#define TLSF_ALIGN_SHIFT (4)
+#else
+#define TLSF_ALIGN_SHIFT (3)
+#endif
+#define TLSF_SL_SHIFT (5)
+#define TLSF_SL_COUNT (1 << TLSF_SL_SHIFT)
+#define TLSF_FL_SHIFT (TLSF_SL_SHIFT + TLSF_ALIGN_SHIFT)
+#define TLSF_SMALL ((size_t) 1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT (__SIZE_WIDTH__ - TLSF_FL_SHIFT + 1)
+
+typedef struct free_index {
+    size_t fl_bitmap;
+    uint32_t sl_bitmap[TLSF_FL_COUNT];
+    metadata_t *heads[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    metadata_t *recent; /* the block inserted last, while still free */
+} free_index_t;
+
+_Static_assert(sizeof(freelink_t) + sizeof(size_t) <= SIZE_DEFAULT_BLOCK,
+               "a free block must be able to hold its links");
+
+#endif /* __TLSF */
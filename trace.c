@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "clock.h"
+
+int g_trace_fd = -1;
+static uint64_t g_trace_start;
+static uint32_t g_trace_threads;
+static bool g_trace_atfork;
+static char g_trace_path[4096];
+
+typedef struct {
+    trace_event_t events[TRACE_BATCH];
+    size_t count;
+    uint32_t thread;
+    bool closing;
+} trace_buffer_t;
+
+static __thread trace_buffer_t t_trace;
+
+uint64_t trace_now(void)
+{
+    return clock_ns() - g_trace_start;
+}
+
+static void write_all(const void *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(g_trace_fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buf = (const char *) buf + n;
+        len -= n;
+    }
+}
+
+/* The file is opened with O_APPEND: every batch lands in one piece. */
+static void flush(trace_buffer_t *buf)
+{
+    if (buf->count)
+        write_all(buf->events, buf->count * sizeof(trace_event_t));
+    buf->count = 0;
+}
+
+static void open_trace(void)
+{
+    char name[sizeof(g_trace_path) + 16];
+    trace_header_t header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .event_size = sizeof(trace_event_t),
+    };
+
+    snprintf(name, sizeof(name), "%s.%d", g_trace_path, (int) getpid());
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                  0644);
+    if (fd < 0)
+        return;
+    g_trace_fd = fd;
+    write_all(&header, sizeof(header));
+}
+
+void trace_init(void)
+{
+    const char *path = getenv("XALLOC_TRACE");
+
+    if (!path || !*path || strlen(path) >= sizeof(g_trace_path))
+        return;
+    strcpy(g_trace_path, path);
+    g_trace_start = clock_ns();
+    open_trace();
+}
+
+/* A forked child records into its own file; the events it inherited are
+ * written by its parent.
+ */
+static void trace_child(void)
+{
+    int fd = g_trace_fd;
+    g_trace_fd = -1;
+    t_trace.count = 0;
+    if (fd >= 0) {
+        close(fd);
+        open_trace();
+    }
+}
+
+void trace_record(uint32_t op, void *ptr, void *old, size_t size,
+                  uint64_t time)
+{
+    trace_buffer_t *buf = &t_trace;
+
+    if (!buf->thread) {
+        buf->thread =
+            __atomic_add_fetch(&g_trace_threads, 1, __ATOMIC_RELAXED);
+        /* not from trace_init(): pthread_atfork() may allocate */
+        if (!__atomic_exchange_n(&g_trace_atfork, true, __ATOMIC_RELAXED))
+            pthread_atfork(NULL, NULL, trace_child);
+    }
+    buf->events[buf->count++] = (trace_event_t){
+        .time = time,
+        .size = size,
+        .ptr = (uintptr_t) ptr,
+        .old = (uintptr_t) old,
+        .thread = buf->thread,
+        .op = op,
+    };
+    if (buf->count == TRACE_BATCH || buf->closing)
+        flush(buf);
+}
+
+/* Events of an exiting thread are written through from now on, as nothing
+ * would flush them later.
+ */
+void trace_thread_exit(void)
+{
+    if (!TRACING())
+        return;
+    t_trace.closing = true;
+    flush(&t_trace);
+}
+
+/* Only the buffer of the thread calling exit() can be flushed: threads
+ * still running at that point lose their last batch.
+ */
+__attribute__((destructor)) static void trace_exit(void)
+{
+    trace_thread_exit();
+}
@@ -0,0 +1,57 @@
+#ifndef __TRACE
+#define __TRACE
+#include <stddef.h>
+#include <stdint.h>
+
+/* With XALLOC_TRACE=path in the environment, every allocation, realloc
+ * and free of the process is recorded into path.<pid>: a trace_header_t
+ * followed by trace_event_t records, which each thread buffers and writes
+ * TRACE_BATCH at a time.
+ */
+#define TRACE_MAGIC 0x43525458 /* "XTRC" */
+#define TRACE_VERSION 1
+#define TRACE_BATCH 256
+
+enum trace_op {
+    TRACE_MALLOC = 1,
+    TRACE_CALLOC,
+    TRACE_REALLOC,
+    TRACE_FREE,
+    TRACE_MEMALIGN,
+};
+
+typedef struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t event_size;
+    uint32_t unused;
+} trace_header_t;
+
+/* Frees are stamped before the block is released and allocations once it
+ * is handed out, so that sorting by time never reuses a live address. A
+ * realloc is stamped when it starts.
+ */
+typedef struct trace_event {
+    uint64_t time;   /* nanoseconds since the trace started */
+    uint64_t size;   /* requested bytes, nmemb * size for calloc */
+    uint64_t ptr;    /* the block returned, or the block freed */
+    uint64_t old;    /* the block passed to realloc, or the alignment */
+    uint32_t thread; /* threads are numbered by their first event */
+    uint32_t op;
+} trace_event_t;
+
+extern int g_trace_fd;
+
+#define TRACING() __builtin_expect(g_trace_fd >= 0, 0)
+#define TRACE(op, ptr, old, size)                                  \
+    do {                                                           \
+        if (TRACING())                                             \
+            trace_record((op), (ptr), (old), (size), trace_now()); \
+    } while (0)
+
+void trace_init(void);
+uint64_t trace_now(void);
+void trace_record(uint32_t op, void *ptr, void *old, size_t size,
+                  uint64_t time);
+void trace_thread_exit(void);
+#endif /* __TRACE */
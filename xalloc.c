@@ -1,78 +1,136 @@
 #include "xalloc.h"
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "heap.h"
-#include "rbtree.h"
+#include "freelist.h"
+#include "prof.h"
+#include "sample.h"
+#include "slab.h"
+#include "trace.h"
 
-static malloc_t g_info = {
-    .root_rbtree = NULL,
-    .mutex = PTHREAD_MUTEX_INITIALIZER
+static malloc_t g_arenas[MAX_ARENAS] = {
+    [0 ... MAX_ARENAS - 1] = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+    },
 };
+static size_t g_narenas = 1;
+static size_t g_mmap_threshold = MMAP_THRESHOLD_DEFAULT;
+static size_t g_quick_max = 0;
+int g_placement = PLACE_BEST;
+static pthread_mutex_t g_arenas_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static inline rbnode_t *find_best(rbnode_t *node, size_t size)
+typedef struct {
+    void *bins[TCACHE_BINS];
+    unsigned short counts[TCACHE_BINS];
+    bool disabled;
+    bool sampler_armed;
+    ptrdiff_t sample_left; /* bytes before the next heap profile sample */
+    size_t mallocs, frees;
+} tcache_t;
+
+static __thread tcache_t t_cache;
+static __thread malloc_t *t_arena = NULL;
+static pthread_key_t g_thread_key;
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+
+/* The profiler times how long a sampled call waits for an arena's mutex
+ * and how long it holds it.
+ */
+static inline void arena_lock(malloc_t *arena)
+{
+    uint64_t start = PROFILING() ? prof_lock_start() : 0;
+    pthread_mutex_lock(&arena->mutex);
+    if (start) {
+        arena->locked_at = prof_ticks();
+        prof_lock(arena->locked_at - start);
+    } else if (PROFILING())
+        arena->locked_at = 0;
+}
+
+static inline void arena_unlock(malloc_t *arena)
 {
-    rbnode_t *tmp = NULL;
-    while (node) {
-        if (node->key >= size) {
-            tmp = node;
-            node = node->left;
-        } else
-            node = node->right;
+    if (PROFILING() && arena->locked_at)
+        prof_unlock(prof_ticks() - arena->locked_at);
+    pthread_mutex_unlock(&arena->mutex);
+}
+
+static void *split_block(malloc_t *arena, metadata_t *node, size_t size)
+{
+    remove_from_freed_list(&arena->free_index, node);
+    metadata_t *new = split(node, size);
+    if (new) {
+        insert_in_freed_list(&arena->free_index, new);
+        arena->stats.splits++;
     }
-    return tmp;
+    return node;
 }
 
-static metadata_t *search_freed_block(rbnode_t *node, size_t size)
+static void release_block(malloc_t *arena, metadata_t *node);
+
+/* Blocks parked in the quick lists stay tagged CFREE and unmerged, chained
+ * through their payload; consolidate() coalesces them all in one pass.
+ */
+#define QUICK_LINK(x) (*(metadata_t **) GET_PAYLOAD(x))
+
+static void consolidate(malloc_t *arena)
 {
-    rbnode_t *tmp = find_best(node, size);
-    if (tmp) {
-        size_t size_tab = tmp->size_tab;
-        metadata_t **tab = tmp->tab_values;
-        for (size_t i = 0; i < size_tab; i++) {
-            if (tab[i])
-                return tab[i];
+    for (size_t i = 0; i < QUICK_BINS; i++) {
+        while (arena->quick[i]) {
+            metadata_t *node = arena->quick[i];
+            arena->quick[i] = QUICK_LINK(node);
+            node->free = NFREE;
+            release_block(arena, node);
         }
     }
-    return NULL;
+    arena->quick_count = 0;
+    arena->stats.consolidations++;
 }
 
-static void *split_block(metadata_t *node, size_t size)
+static inline metadata_t *quick_get(malloc_t *arena, size_t size)
 {
-    g_info.root_rbtree = remove_from_freed_list(g_info.root_rbtree, node);
-    if (node->size > size + sizeof(size_t) &&
-        node->size - size > sizeof(rbnode_t) + SIZE_DEFAULT_BLOCK) {
-        metadata_t *new = (void *) node + size;
-        new->size = node->size - size;
-        new->free = YFREE;
-        new->prev = node;
-        new->next = node->next;
-        node->next = new;
-        node->size = size;
-        if (new->next)
-            new->next->prev = new;
-        g_info.root_rbtree = insert_in_freed_list(g_info.root_rbtree, new);
+    size_t idx = QUICK_IDX(size - META_SIZE);
+    metadata_t *node = arena->quick[idx];
+    if (node) {
+        arena->quick[idx] = QUICK_LINK(node);
+        arena->quick_count--;
+        node->free = NFREE;
     }
     return node;
 }
 
-void *malloc(size_t size)
+static inline void quick_put(malloc_t *arena, metadata_t *node)
 {
-    metadata_t *tmp;
-    void *ptr;
+    size_t idx = QUICK_IDX(node->size - META_SIZE);
+    node->free = CFREE;
+    QUICK_LINK(node) = arena->quick[idx];
+    arena->quick[idx] = node;
+    if (++arena->quick_count > QUICK_THRESHOLD)
+        consolidate(arena);
+}
 
-    pthread_mutex_lock(&g_info.mutex);
-    if (size < SIZE_DEFAULT_BLOCK)
-        size = SIZE_DEFAULT_BLOCK;
-    size = ALIGN_BYTES(size) + META_SIZE;
-    if ((tmp = search_freed_block(g_info.root_rbtree, size)))
-        ptr = split_block(tmp, size);
-    else
-        ptr = get_heap(size);
-    pthread_mutex_unlock(&g_info.mutex);
-    return ptr ? (GET_PAYLOAD(ptr)) : NULL;
+static void *alloc_block(malloc_t *arena, size_t size, bool *zeroed)
+{
+    metadata_t *tmp;
+    int fresh;
+    *zeroed = false;
+    if (size - META_SIZE <= g_quick_max && (tmp = quick_get(arena, size)))
+        return tmp;
+    if ((tmp = search_freed_block(&arena->free_index, size)))
+        return split_block(arena, tmp, size);
+    if (arena->quick_count) {
+        /* a miss: merge the parked blocks and look again before growing */
+        consolidate(arena);
+        if ((tmp = search_freed_block(&arena->free_index, size)))
+            return split_block(arena, tmp, size);
+    }
+    tmp = get_heap(&arena->heap, size, &fresh);
+    *zeroed = fresh;
+    return tmp;
 }
 
 static void invalid_pointer(void *ptr)
@@ -89,54 +147,843 @@ static void double_free(void *ptr)
     abort();
 }
 
-static inline metadata_t *try_fusion(metadata_t *node)
+static inline metadata_t *try_fusion(malloc_t *arena, metadata_t *node)
 {
-    while (IS_FREE(node->prev)) {
-        g_info.root_rbtree =
-            remove_from_freed_list(g_info.root_rbtree, node->prev);
-        node = fusion(node->prev, node);
+    metadata_t *other;
+    if (node->flags & PREV_FREE) {
+        other = PREV_BLOCK(node);
+        remove_from_freed_list(&arena->free_index, other);
+        node = fusion(other, node);
+        arena->stats.fusions++;
     }
-    while (IS_FREE(node->next)) {
-        g_info.root_rbtree =
-            remove_from_freed_list(g_info.root_rbtree, node->next);
-        node = fusion(node, node->next);
+    other = NEXT_BLOCK(node);
+    if (IS_FREE(other)) {
+        remove_from_freed_list(&arena->free_index, other);
+        node = fusion(node, other);
+        arena->stats.fusions++;
     }
     return node;
 }
 
+/* Called with the owning arena's mutex held. */
+static void release_block(malloc_t *arena, metadata_t *node)
+{
+    node = try_fusion(arena, node);
+    if (IS_LAST(node)) {
+        change_break(&arena->heap, node);
+        arena->stats.breaks++;
+    } else
+        insert_in_freed_list(&arena->free_index, node);
+}
 
+static inline malloc_t *arena_of(void *ptr)
+{
+    if (slab_owns(ptr))
+        return &g_arenas[SLAB_RUN_OF(ptr)->arena];
+    return &g_arenas[((metadata_t *) GET_NODE(ptr))->arena];
+}
 
-void free(void *ptr)
+static inline size_t usable_size(void *ptr)
 {
-    if (!ptr)
+    if (slab_owns(ptr))
+        return SLAB_RUN_OF(ptr)->size;
+    return ((metadata_t *) GET_NODE(ptr))->size - META_SIZE;
+}
+
+/* Called with the arena's mutex held: returns a payload of at least @size
+ * bytes, a slab object for small sizes and a heap block otherwise. @zeroed
+ * tells whether the payload is still as the kernel handed it out.
+ */
+static void *arena_alloc(malloc_t *arena, size_t size, bool *zeroed)
+{
+    void *ptr;
+    int fresh;
+    if (size <= SLAB_MAX_SIZE &&
+        (ptr = slab_alloc(&arena->slab, arena->heap.arena, size, &fresh))) {
+        *zeroed = fresh;
+        return ptr;
+    }
+    if (size < SIZE_DEFAULT_BLOCK)
+        size = SIZE_DEFAULT_BLOCK;
+    ptr = alloc_block(arena, size + META_SIZE, zeroed);
+    return ptr ? GET_PAYLOAD(ptr) : NULL;
+}
+
+/* Called with the owning arena's mutex held. */
+static void arena_release(malloc_t *arena, void *ptr)
+{
+    if (slab_owns(ptr)) {
+        if (slab_free(&arena->slab, ptr))
+            double_free(ptr);
+        return;
+    }
+    metadata_t *node = GET_NODE(ptr);
+    if (node->size - META_SIZE <= g_quick_max)
+        quick_put(arena, node);
+    else {
+        node->free = NFREE;
+        release_block(arena, node);
+    }
+}
+
+/* Called with the arena's mutex held: resize a heap block to @size bytes
+ * without moving it, by absorbing a free successor or the unused end of its
+ * segment when growing and by releasing the tail when shrinking.
+ */
+static bool resize_block(malloc_t *arena, metadata_t *node, size_t size)
+{
+    metadata_t *next = NEXT_BLOCK(node);
+    if (size > node->size) {
+        if (IS_FREE(next) && node->size + next->size >= size) {
+            remove_from_freed_list(&arena->free_index, next);
+            fusion(node, next);
+        } else if (!IS_LAST(node) || !extend_block(&arena->heap, node, size))
+            return false;
+    }
+    metadata_t *tail = split(node, size);
+    if (tail)
+        release_block(arena, tail);
+    return true;
+}
+
+/* Called with the arena's mutex held: carve a heap block whose payload is
+ * aligned on @align bytes out of a larger one, giving the slack on both
+ * sides back as free blocks.
+ */
+static void *arena_memalign(malloc_t *arena, size_t align, size_t size)
+{
+    bool zeroed;
+    if (size < SIZE_DEFAULT_BLOCK)
+        size = SIZE_DEFAULT_BLOCK;
+    size = ALIGN_BYTES(size) + META_SIZE;
+
+    metadata_t *node = alloc_block(arena, size + align + MIN_BLOCK_SIZE,
+                                   &zeroed);
+    if (!node)
+        return NULL;
+    uintptr_t payload = (uintptr_t) GET_PAYLOAD(node);
+    if (payload & (align - 1)) {
+        /* leave room for a whole block in front */
+        uintptr_t aligned = (payload + MIN_BLOCK_SIZE + align - 1) & -align;
+        metadata_t *lead = node;
+        node = GET_NODE(aligned);
+        node->size = lead->size - (aligned - payload);
+        node->free = NFREE;
+        node->arena = lead->arena;
+        node->flags = 0;
+        lead->size = aligned - payload;
+        release_block(arena, lead);
+    }
+    metadata_t *tail = split(node, size);
+    if (tail)
+        release_block(arena, tail);
+    return GET_PAYLOAD(node);
+}
+
+/* Cut @count blocks of @block bytes side by side out of @node, a block
+ * taken off the tree or fresh from the heap; the last one keeps whatever
+ * is too small to stand alone.
+ */
+static void carve_blocks(malloc_t *arena, metadata_t *node, size_t block,
+                         size_t count, void **out)
+{
+    metadata_t *tail = split(node, count * block);
+    if (tail) {
+        release_block(arena, tail);
+        arena->stats.splits++;
+    }
+    size_t total = node->size;
+    for (size_t i = 0; i < count; i++) {
+        node->size = (i == count - 1) ? total - i * block : block;
+        node->free = NFREE;
+        node->arena = arena->heap.arena;
+        node->flags = 0;
+        out[i] = GET_PAYLOAD(node);
+        node = NEXT_BLOCK(node);
+    }
+}
+
+/* Called with the arena's mutex held: fill @out with up to @count payloads
+ * of @size bytes, carving the heap blocks from as few free blocks as the
+ * tree allows, or from a single run of the heap. Returns how many it got.
+ */
+static size_t arena_alloc_batch(malloc_t *arena, size_t size, size_t count,
+                                void **out)
+{
+    size_t n = 0;
+    int fresh;
+    bool zeroed;
+
+    if (size <= SLAB_MAX_SIZE) {
+        while (n < count &&
+               (out[n] = slab_alloc(&arena->slab, arena->heap.arena, size,
+                                    &fresh)))
+            n++;
+    }
+    size_t block = (size < SIZE_DEFAULT_BLOCK ? SIZE_DEFAULT_BLOCK : size) +
+                   META_SIZE;
+    metadata_t *node;
+    while (n < count && block - META_SIZE <= g_quick_max &&
+           (node = quick_get(arena, block)))
+        out[n++] = GET_PAYLOAD(node);
+    if (n < count && arena->quick_count)
+        consolidate(arena);
+
+    while (n < count) {
+        size_t want = count - n, fit;
+        if (want > PTRDIFF_MAX / block)
+            want = PTRDIFF_MAX / block;
+        if ((node = search_freed_block(&arena->free_index, want * block)) ||
+            (node = search_freed_block(&arena->free_index, block))) {
+            remove_from_freed_list(&arena->free_index, node);
+            fit = node->size / block;
+            want = fit < want ? fit : want;
+        } else if (!(node = get_heap(&arena->heap, want * block, &fresh))) {
+            /* no room for the whole run: one block at a time */
+            if (!(node = alloc_block(arena, block, &zeroed)))
+                break;
+            want = 1;
+        }
+        carve_blocks(arena, node, block, want, out + n);
+        n += want;
+    }
+    return n;
+}
+
+/* Blocks of a free_batch() waiting for their coalescing pass, gathered
+ * BATCH_CHUNK at a time.
+ */
+#define BFREE 0xBA7C4F2E
+#define BATCH_CHUNK (64)
+
+/* Called with the arena's mutex held: release the BFREE heap blocks of
+ * @nodes, merging each run of neighbours among them before the run meets
+ * its free neighbours and the tree.
+ */
+static void release_batch(malloc_t *arena, metadata_t **nodes, size_t count)
+{
+    size_t runs = 0;
+    for (size_t i = 0; i < count; i++) {
+        metadata_t *node = nodes[i];
+        if (node->free != BFREE)
+            continue;
+        for (metadata_t *next = NEXT_BLOCK(node); next->free == BFREE;
+             next = NEXT_BLOCK(node)) {
+            next->free = 0;
+            fusion(node, next);
+            arena->stats.fusions++;
+        }
+        node->free = NFREE;
+        nodes[runs++] = node;
+    }
+    /* the merged blocks are never looked at again: releasing a run may
+     * unmap its segment */
+    for (size_t i = 0; i < runs; i++)
+        release_block(arena, nodes[i]);
+}
+
+/* Cached payloads are chained through their first word, as the header has
+ * no room for a link and its flags are still updated by the owning arena
+ * while the block sits in the cache. The second word holds a cookie so that
+ * freeing a cached pointer again is caught.
+ */
+#define TCACHE_LINK(x) (*(void **) (x))
+#define TCACHE_KEY(x) (((uintptr_t *) (x))[1])
+#define TCACHE_COOKIE ((uintptr_t) g_arenas ^ CFREE)
+
+/* Frees from a thread attached to another arena are pushed on the owning
+ * arena's remote_free stack without taking any lock; the owner drains the
+ * whole stack on its next allocation, so coalescing stays on its side.
+ * Heap blocks wait there tagged RFREE, so that freeing one again is caught.
+ */
+static inline bool is_remote(malloc_t *arena)
+{
+    return arena != t_arena && arena->threads;
+}
+
+static void remote_push(malloc_t *arena, void *ptr)
+{
+    void *head = __atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED);
+    if (!slab_owns(ptr))
+        ((metadata_t *) GET_NODE(ptr))->free = RFREE;
+    do
+        TCACHE_LINK(ptr) = head;
+    while (!__atomic_compare_exchange_n(&arena->remote_free, &head, ptr, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Called with the arena's mutex held. */
+static void remote_drain(malloc_t *arena)
+{
+    if (!__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED))
+        return;
+
+    void *list =
+        __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (list) {
+        void *ptr = list;
+        list = TCACHE_LINK(ptr);
+        if (!slab_owns(ptr)) {
+            if (is_invalid_pointer(&arena->heap, ptr))
+                invalid_pointer(ptr);
+            ((metadata_t *) GET_NODE(ptr))->free = NFREE;
+        }
+        arena_release(arena, ptr);
+        arena->stats.remote_frees++;
+    }
+}
+
+/* Called with the mutex of the thread's own arena held. */
+static inline void tcache_fold(malloc_t *arena)
+{
+    arena->stats.mallocs += t_cache.mallocs;
+    arena->stats.frees += t_cache.frees;
+    t_cache.mallocs = t_cache.frees = 0;
+}
+
+static void release_cached(void *list, size_t count)
+{
+    bool locked = false;
+    while (list && count--) {
+        void *ptr = list;
+        malloc_t *arena = arena_of(ptr);
+        list = TCACHE_LINK(ptr);
+        if (is_remote(arena)) {
+            remote_push(arena, ptr);
+            continue;
+        }
+        if (arena != t_arena) {
+            /* an arena nobody is attached to any more */
+            if (locked)
+                arena_unlock(t_arena);
+            locked = false;
+            arena_lock(arena);
+            arena_release(arena, ptr);
+            arena_unlock(arena);
+            continue;
+        }
+        if (!locked) {
+            arena_lock(t_arena);
+            tcache_fold(t_arena);
+            locked = true;
+        }
+        arena_release(arena, ptr);
+    }
+    if (locked)
+        arena_unlock(t_arena);
+}
+
+static void thread_destroy(void *arg)
+{
+    tcache_t *cache = arg;
+
+    cache->disabled = true;
+    for (size_t i = 0; i < TCACHE_BINS; i++) {
+        release_cached(cache->bins[i], cache->counts[i]);
+        cache->bins[i] = NULL;
+        cache->counts[i] = 0;
+    }
+    pthread_mutex_lock(&g_arenas_mutex);
+    t_arena->threads--;
+    pthread_mutex_unlock(&g_arenas_mutex);
+    arena_lock(t_arena);
+    remote_drain(t_arena);
+    tcache_fold(t_arena);
+    arena_unlock(t_arena);
+    trace_thread_exit();
+    prof_thread_exit();
+}
+
+static void placement_init(void)
+{
+    const char *name = getenv("XALLOC_PLACEMENT");
+
+    if (!name)
         return;
+    if (!strcmp(name, "lifo"))
+        g_placement = PLACE_LIFO;
+    else if (!strcmp(name, "address"))
+        g_placement = PLACE_ADDRESS;
+}
+
+static void arenas_init(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > MAX_ARENAS)
+        cores = MAX_ARENAS;
+    if (cores > 1)
+        g_narenas = cores;
+    for (size_t i = 0; i < g_narenas; i++)
+        g_arenas[i].heap.arena = i;
+    /* reached from the first allocation: none of these may allocate */
+    heap_init();
+    placement_init();
+    slab_init();
+    trace_init();
+    prof_init();
+    sample_init();
+    pthread_key_create(&g_thread_key, thread_destroy);
+}
+
+/* Every lock of the allocator is registered here, the modules' through
+ * their fork hooks. They are all taken before fork(), in the order a
+ * thread may nest them, so that the child finds none held by a thread it
+ * does not have: g_arenas_mutex, the arenas, then the slab region and the
+ * profilers' leaf locks.
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&g_arenas_mutex);
+    for (size_t i = 0; i < g_narenas; i++)
+        pthread_mutex_lock(&g_arenas[i].mutex);
+    slab_fork_prepare();
+    prof_fork_prepare();
+    sample_fork_prepare();
+}
+
+static void fork_parent(void)
+{
+    sample_fork_parent();
+    prof_fork_parent();
+    slab_fork_parent();
+    for (size_t i = g_narenas; i-- > 0;)
+        pthread_mutex_unlock(&g_arenas[i].mutex);
+    pthread_mutex_unlock(&g_arenas_mutex);
+}
+
+/* Only the forking thread lives on in the child. */
+static void fork_child(void)
+{
+    for (size_t i = 0; i < g_narenas; i++) {
+        g_arenas[i].threads = 0;
+        pthread_mutex_init(&g_arenas[i].mutex, NULL);
+    }
+    if (t_arena)
+        t_arena->threads = 1;
+    pthread_mutex_init(&g_arenas_mutex, NULL);
+    slab_fork_child();
+    prof_fork_child();
+    sample_fork_child();
+}
+
+/* Registered at load time rather than from arenas_init(), which runs under
+ * malloc(): pthread_atfork() may allocate.
+ */
+__attribute__((constructor)) static void fork_init(void)
+{
+    pthread_once(&g_init_once, arenas_init);
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/* Attach the calling thread to the arena serving the fewest threads. */
+static malloc_t *thread_arena(void)
+{
+    if (t_arena)
+        return t_arena;
+
+    pthread_once(&g_init_once, arenas_init);
+    pthread_mutex_lock(&g_arenas_mutex);
+    malloc_t *best = &g_arenas[0];
+    for (size_t i = 1; i < g_narenas; i++) {
+        if (g_arenas[i].threads < best->threads)
+            best = &g_arenas[i];
+    }
+    best->threads++;
+    pthread_mutex_unlock(&g_arenas_mutex);
+    t_arena = best;
+    pthread_setspecific(g_thread_key, &t_cache);
+    return best;
+}
+
+static inline void *tcache_get(size_t size)
+{
+    size_t idx = TCACHE_IDX(size);
+    void *ptr = t_cache.bins[idx];
+    if (ptr) {
+        t_cache.bins[idx] = TCACHE_LINK(ptr);
+        t_cache.counts[idx]--;
+        TCACHE_KEY(ptr) = 0;
+        if (!slab_owns(ptr))
+            ((metadata_t *) GET_NODE(ptr))->free = NFREE;
+    }
+    return ptr;
+}
+
+static inline void tcache_put(void *ptr, size_t size)
+{
+    size_t idx = TCACHE_IDX(size);
+    if (!slab_owns(ptr))
+        ((metadata_t *) GET_NODE(ptr))->free = CFREE;
+    TCACHE_LINK(ptr) = t_cache.bins[idx];
+    TCACHE_KEY(ptr) = TCACHE_COOKIE;
+    t_cache.bins[idx] = ptr;
+    t_cache.counts[idx]++;
+}
+
+static bool tcache_contains(void *ptr, size_t size)
+{
+    for (void *it = t_cache.bins[TCACHE_IDX(size)]; it; it = TCACHE_LINK(it)) {
+        if (it == ptr)
+            return true;
+    }
+    return false;
+}
+
+/* Called with the arena mutex held: move up to TCACHE_BATCH objects of
+ * exactly @size from the arena into the thread's bin.
+ */
+static void tcache_fill(malloc_t *arena, size_t size)
+{
+    size_t idx = TCACHE_IDX(size);
+    bool zeroed;
+    while (t_cache.counts[idx] < TCACHE_BATCH) {
+        void *ptr = arena_alloc(arena, size, &zeroed);
+        if (!ptr)
+            break;
+        if (usable_size(ptr) != size) {
+            arena_release(arena, ptr);
+            break;
+        }
+        tcache_put(ptr, size);
+    }
+}
+
+/* Called without any lock: hand TCACHE_BATCH objects of the bin back to
+ * their arenas.
+ */
+static void tcache_flush(size_t idx)
+{
+    void *list = t_cache.bins[idx];
+    void *rest = list;
+    for (size_t i = 0; i < TCACHE_BATCH && rest; i++)
+        rest = TCACHE_LINK(rest);
+    t_cache.bins[idx] = rest;
+    t_cache.counts[idx] -= TCACHE_BATCH;
+    release_cached(list, TCACHE_BATCH);
+}
+
+/* The usable size every request of @size bytes is rounded up to. */
+static inline size_t request_size(size_t size)
+{
+    if (!size)
+        size = 1;
+    return (size <= SLAB_MAX_SIZE) ? SLAB_SIZE(size) : ALIGN_BYTES(size);
+}
+
+static void *alloc_unsampled(size_t size, bool *zeroed)
+{
+    malloc_t *arena = thread_arena();
+    void *ptr;
+
+    *zeroed = false;
+    t_cache.mallocs++;
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = request_size(size);
+    if (size >= g_mmap_threshold && size > SLAB_MAX_SIZE) {
+        if (!(ptr = get_mapped(size + META_SIZE, arena->heap.arena)))
+            return NULL;
+        *zeroed = true;
+        return GET_PAYLOAD(ptr);
+    }
+    bool cached = size <= TCACHE_MAX_SIZE && !t_cache.disabled;
+    if (cached && (ptr = tcache_get(size)))
+        return ptr;
+
+    arena_lock(arena);
+    remote_drain(arena);
+    tcache_fold(arena);
+    ptr = arena_alloc(arena, size, zeroed);
+    if (ptr && cached)
+        tcache_fill(arena, size);
+    arena_unlock(arena);
+    return ptr;
+}
+
+/* Reached once the thread has allocated the bytes drawn for it, and on its
+ * first allocation, which only draws. A sampled block is a heap block,
+ * whose magic says so, or a mapped one: never a slab object, which has no
+ * header to mark. @caller is the return address of the public entry point,
+ * where the sample's stack starts.
+ */
+static __attribute__((noinline)) void *alloc_sampled(size_t size,
+                                                     bool *zeroed,
+                                                     void *caller)
+{
+    bool armed = t_cache.sampler_armed;
+
+    thread_arena();
+    t_cache.sampler_armed = true;
+    t_cache.sample_left = sample_interval();
+    if (!armed || !SAMPLING() || size > PTRDIFF_MAX)
+        return alloc_unsampled(size, zeroed);
+
+    size_t block = (size <= SLAB_MAX_SIZE) ? SLAB_MAX_SIZE + 1 : size;
+    void *ptr = alloc_unsampled(block, zeroed);
+    if (ptr) {
+        if (!IS_MAPPED(GET_NODE(ptr)))
+            ((metadata_t *) GET_NODE(ptr))->free = SAMPD;
+        sample_record(ptr, size, caller);
+    }
+    return ptr;
+}
+
+/* Unsampled allocations only count down the thread's sampling budget. */
+static inline void *alloc_payload(size_t size, bool *zeroed, void *caller)
+{
+    if (__builtin_expect(__builtin_sub_overflow(t_cache.sample_left, size,
+                                                &t_cache.sample_left) ||
+                             t_cache.sample_left < 0,
+                         0))
+        return alloc_sampled(size, zeroed, caller);
+    return alloc_unsampled(size, zeroed);
+}
+
+void *malloc(size_t size)
+{
+    bool zeroed;
+    uint64_t start = PROF_BEGIN();
+    void *ptr = alloc_payload(size, &zeroed, __builtin_return_address(0));
+    TRACE(TRACE_MALLOC, ptr, NULL, size);
+    PROF_END(PROF_MALLOC, size, start);
+    return ptr;
+}
 
-    pthread_mutex_lock(&g_info.mutex);
+/* Check what can be checked of @ptr without a lock. A mapped block needs
+ * no more and is released at once: returns true then.
+ */
+static bool release_if_mapped(void *ptr)
+{
+    if (slab_owns(ptr)) {
+        if (is_invalid_slab_pointer(ptr))
+            invalid_pointer(ptr);
+        return false;
+    }
     metadata_t *node = GET_NODE(ptr);
-    if (is_invalid_pointer(ptr))
+    if (IS_MAPPED(node)) {
+        if (is_invalid_pointer(NULL, ptr))
+            invalid_pointer(ptr);
+        if (SAMPLING())
+            sample_forget(ptr);
+        release_mapped(node);
+        return true;
+    }
+    /* the segments are only walked under the arena's mutex, a block
+     * parked in the thread cache is checked by its header */
+    if (node->arena >= g_narenas || !IS_VALID(node))
         invalid_pointer(ptr);
-    if (node->free == YFREE)
+    if (node->free == YFREE || node->free == CFREE || node->free == RFREE)
         double_free(ptr);
-    node = try_fusion(node);
-    if (!node->next)
-        change_break(node);
-    else
-        g_info.root_rbtree = insert_in_freed_list(g_info.root_rbtree, node);
-    pthread_mutex_unlock(&g_info.mutex);
+    if (node->free == SAMPD) {
+        sample_forget(ptr);
+        node->free = NFREE;
+    }
+    return false;
+}
+
+static void release_payload(void *ptr)
+{
+    t_cache.frees++;
+    if (release_if_mapped(ptr))
+        return;
+    thread_arena();
+    size_t size = usable_size(ptr);
+    if (size <= TCACHE_MAX_SIZE && !t_cache.disabled) {
+        if (TCACHE_KEY(ptr) == TCACHE_COOKIE && tcache_contains(ptr, size))
+            double_free(ptr);
+        if (t_cache.counts[TCACHE_IDX(size)] >= TCACHE_COUNT)
+            tcache_flush(TCACHE_IDX(size));
+        tcache_put(ptr, size);
+        return;
+    }
+
+    malloc_t *arena = arena_of(ptr);
+    if (is_remote(arena)) {
+        remote_push(arena, ptr);
+        return;
+    }
+    arena_lock(arena);
+    if (!slab_owns(ptr) && is_invalid_pointer(&arena->heap, ptr))
+        invalid_pointer(ptr);
+    arena_release(arena, ptr);
+    if (arena == t_arena)
+        tcache_fold(arena);
+    arena_unlock(arena);
 }
 
+void free(void *ptr)
+{
+    if (!ptr)
+        return;
+    uint64_t start = PROF_BEGIN();
+    size_t size = PROFILING() ? usable_size(ptr) : 0;
+    TRACE(TRACE_FREE, ptr, NULL, 0);
+    release_payload(ptr);
+    PROF_END(PROF_FREE, size, start);
+}
+
+/* The caller vouches for @size, the size it asked for: a small block goes
+ * straight to the thread cache, in the bin of that request, without its
+ * header being validated or its size looked up. The block is at least as
+ * large as the bin says. Only the magic of heap blocks is read, on the
+ * line tcache_put() writes anyway, as mapped and sampled blocks take the
+ * long way.
+ */
+void free_sized(void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+    uint64_t start = PROF_BEGIN();
+    TRACE(TRACE_FREE, ptr, NULL, size);
+    size_t bin = request_size(size);
+    if (bin > TCACHE_MAX_SIZE || t_cache.disabled || !t_arena ||
+        (!slab_owns(ptr) && (IS_MAPPED(GET_NODE(ptr)) ||
+                             ((metadata_t *) GET_NODE(ptr))->free == SAMPD)))
+        release_payload(ptr);
+    else {
+        t_cache.frees++;
+        if (t_cache.counts[TCACHE_IDX(bin)] >= TCACHE_COUNT)
+            tcache_flush(TCACHE_IDX(bin));
+        tcache_put(ptr, bin);
+    }
+    PROF_END(PROF_FREE, size, start);
+}
+
+/* Blocks aligned beyond ALIGN_BYTES are heap blocks of at least the
+ * requested size, so the alignment changes nothing here.
+ */
+void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+    (void) alignment;
+    free_sized(ptr, size);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    return ptr ? usable_size(ptr) : 0;
+}
+
+/* The arena's mutex is taken once for the whole batch and the thread cache
+ * is bypassed but for what it already holds. Returns the number of
+ * payloads stored in @out, fewer than @count when memory runs out.
+ */
+size_t malloc_batch(size_t size, size_t count, void **out)
+{
+    malloc_t *arena = thread_arena();
+    size_t n = 0, request = size;
+
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return 0;
+    }
+    size = request_size(size);
+    if (size >= g_mmap_threshold && size > SLAB_MAX_SIZE) {
+        metadata_t *node;
+        while (n < count &&
+               (node = get_mapped(size + META_SIZE, arena->heap.arena)))
+            out[n++] = GET_PAYLOAD(node);
+    } else {
+        if (size <= TCACHE_MAX_SIZE && !t_cache.disabled) {
+            while (n < count && (out[n] = tcache_get(size)))
+                n++;
+        }
+        if (n < count) {
+            arena_lock(arena);
+            remote_drain(arena);
+            tcache_fold(arena);
+            n += arena_alloc_batch(arena, size, count - n, out + n);
+            arena_unlock(arena);
+        }
+    }
+    t_cache.mallocs += n;
+    for (size_t i = 0; TRACING() && i < n; i++)
+        TRACE(TRACE_MALLOC, out[i], NULL, request);
+    return n;
+}
+
+/* Frees the payloads of @ptrs, which may hold NULLs, taking each arena's
+ * mutex once per stretch of pointers it owns. Heap blocks are gathered
+ * BATCH_CHUNK at a time and coalesced with each other before they are
+ * released.
+ */
+void free_batch(void **ptrs, size_t count)
+{
+    metadata_t *nodes[BATCH_CHUNK];
+    malloc_t *locked = NULL;
+    size_t n = 0;
+
+    thread_arena();
+    for (size_t i = 0; i < count; i++) {
+        void *ptr = ptrs[i];
+        if (!ptr)
+            continue;
+        TRACE(TRACE_FREE, ptr, NULL, 0);
+        t_cache.frees++;
+        if (!slab_owns(ptr) && ((metadata_t *) GET_NODE(ptr))->free == BFREE)
+            double_free(ptr);
+        if (release_if_mapped(ptr))
+            continue;
+        malloc_t *arena = arena_of(ptr);
+        if (is_remote(arena)) {
+            remote_push(arena, ptr);
+            continue;
+        }
+        if (arena != locked) {
+            if (locked) {
+                release_batch(locked, nodes, n);
+                arena_unlock(locked);
+            }
+            n = 0;
+            locked = arena;
+            arena_lock(arena);
+            if (arena == t_arena)
+                tcache_fold(arena);
+        }
+        if (slab_owns(ptr)) {
+            if (slab_free(&arena->slab, ptr))
+                double_free(ptr);
+            continue;
+        }
+        metadata_t *node = GET_NODE(ptr);
+        if (is_invalid_pointer(&arena->heap, ptr))
+            invalid_pointer(ptr);
+        node->free = BFREE;
+        nodes[n++] = node;
+        if (n == BATCH_CHUNK) {
+            release_batch(arena, nodes, n);
+            n = 0;
+        }
+    }
+    if (locked) {
+        release_batch(locked, nodes, n);
+        if (locked == t_arena)
+            tcache_fold(locked);
+        arena_unlock(locked);
+    }
+}
+
+/* Memory fresh from the kernel is already zero: only recycled memory is
+ * cleared, and never under an arena's mutex.
+ */
 void *calloc(size_t nmemb, size_t size)
 {
     if (!nmemb || !size)
         return NULL;
 
-    void *ptr;
-    if (!(ptr = malloc(size * nmemb)))
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
         return NULL;
-
-    pthread_mutex_lock(&g_info.mutex);
-    memset(ptr, 0, ALIGN_BYTES(size * nmemb));
-    pthread_mutex_unlock(&g_info.mutex);
+    }
+    bool zeroed;
+    uint64_t start = PROF_BEGIN();
+    void *ptr = alloc_payload(total, &zeroed, __builtin_return_address(0));
+    if (ptr && !zeroed)
+        memset(ptr, 0, total);
+    TRACE(TRACE_CALLOC, ptr, NULL, total);
+    PROF_END(PROF_CALLOC, total, start);
     return ptr;
 }
 
@@ -146,27 +993,284 @@ void *free_realloc(void *ptr)
     return NULL;
 }
 
-void *realloc(void *ptr, size_t size)
+static void *resize_payload(void *ptr, size_t size, void *caller)
 {
+    bool zeroed;
     if (!ptr)
-        return malloc(size);
-    if (!size)
-        return free_realloc(ptr);
+        return alloc_payload(size, &zeroed, caller);
+    if (!size) {
+        release_payload(ptr);
+        return NULL;
+    }
 
-    ptr = (void *) ptr - META_SIZE;
-    metadata_t *tmp = (metadata_t *) ptr;
-    metadata_t *new = ptr;
-    if (size + META_SIZE > tmp->size) {
-        if (!(new = malloc(size)))
+    size_t old_size = usable_size(ptr);
+    metadata_t *node = GET_NODE(ptr);
+    if (slab_owns(ptr)) {
+        if (size <= old_size)
+            return ptr;
+    } else if (IS_MAPPED(node)) {
+        if (size > SIZE_MAX - META_SIZE ||
+            !(node = resize_mapped(node, size + META_SIZE)))
             return NULL;
+        if (SAMPLING())
+            sample_resize(ptr, GET_PAYLOAD(node), size);
+        return GET_PAYLOAD(node);
+    } else if (size <= SIZE_MAX - MIN_BLOCK_SIZE) {
+        malloc_t *arena = &g_arenas[node->arena];
+        size_t need = (size < SIZE_DEFAULT_BLOCK) ? SIZE_DEFAULT_BLOCK : size;
+        arena_lock(arena);
+        bool resized = resize_block(arena, node, ALIGN_BYTES(need) + META_SIZE);
+        arena_unlock(arena);
+        if (resized && node->free == SAMPD)
+            sample_resize(ptr, ptr, size);
+        if (resized)
+            return ptr;
+    }
 
-        size = ALIGN_BYTES(size);
-        pthread_mutex_lock(&g_info.mutex);
-        memcpy(new, (void *) ptr + META_SIZE,
-               (size <= tmp->size) ? (size) : (tmp->size));
-        pthread_mutex_unlock(&g_info.mutex);
-        free((void *) ptr + META_SIZE);
-    } else
-        new = GET_PAYLOAD(new);
+    void *new;
+    if (!(new = alloc_payload(size, &zeroed, caller)))
+        return NULL;
+    memcpy(new, ptr, (size < old_size) ? size : old_size);
+    release_payload(ptr);
+    return new;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    uint64_t start = TRACING() ? trace_now() : 0;
+    uint64_t ticks = PROF_BEGIN();
+    void *new = resize_payload(ptr, size, __builtin_return_address(0));
+    if (TRACING())
+        trace_record(TRACE_REALLOC, new, ptr, size, start);
+    PROF_END(PROF_REALLOC, size, ticks);
     return new;
-}
\ No newline at end of file
+}
+
+/* @align is a power of two. Aligned blocks come from a heap, where the
+ * slack is reusable, unless they are large enough to be mapped or their
+ * alignment would not fit a segment: slab objects sit at fixed offsets.
+ */
+static void *alloc_aligned(size_t align, size_t size, void *caller)
+{
+    void *ptr;
+    bool zeroed;
+    uint64_t start = PROF_BEGIN();
+
+    if (align <= ALIGN_BYTES(1))
+        ptr = alloc_payload(size, &zeroed, caller);
+    else if (align > PTRDIFF_MAX / 2 || size > PTRDIFF_MAX / 2) {
+        errno = ENOMEM;
+        ptr = NULL;
+    } else if ((size >= g_mmap_threshold && size > SLAB_MAX_SIZE) ||
+               align >= SEGMENT_SIZE) {
+        malloc_t *arena = thread_arena();
+        t_cache.mallocs++;
+        metadata_t *node = get_mapped_aligned(request_size(size) + META_SIZE,
+                                              align, arena->heap.arena);
+        ptr = node ? GET_PAYLOAD(node) : NULL;
+    } else {
+        malloc_t *arena = thread_arena();
+        t_cache.mallocs++;
+        arena_lock(arena);
+        remote_drain(arena);
+        tcache_fold(arena);
+        ptr = arena_memalign(arena, align, size);
+        arena_unlock(arena);
+    }
+    TRACE(TRACE_MEMALIGN, ptr, (void *) align, size);
+    PROF_END(PROF_MEMALIGN, size, start);
+    return ptr;
+}
+
+static inline bool is_power_of_two(size_t x)
+{
+    return x && !(x & (x - 1));
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) || !is_power_of_two(alignment))
+        return EINVAL;
+    void *ptr = alloc_aligned(alignment, size, __builtin_return_address(0));
+    if (!ptr)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (!is_power_of_two(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return alloc_aligned(alignment, size, __builtin_return_address(0));
+}
+
+/* As glibc's: an alignment no larger than the natural one, 0 included,
+ * is a plain allocation, and any other is rounded up to a power of two.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    if (alignment > PTRDIFF_MAX / 2 + 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment < ALIGN_BYTES(1))
+        alignment = ALIGN_BYTES(1);
+    while (!is_power_of_two(alignment))
+        alignment = (alignment | (alignment - 1)) + 1;
+    return alloc_aligned(alignment, size, __builtin_return_address(0));
+}
+
+void *valloc(size_t size)
+{
+    return alloc_aligned(getpagesize(), size, __builtin_return_address(0));
+}
+
+/* Rounds @size up to whole pages. */
+void *pvalloc(size_t size)
+{
+    size_t page = getpagesize();
+    if (size > PTRDIFF_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return alloc_aligned(page, size ? (size + page - 1) & -page : page,
+                         __builtin_return_address(0));
+}
+
+int malloc_trim(size_t pad)
+{
+    size_t released = 0;
+
+    pthread_once(&g_init_once, arenas_init);
+    for (size_t i = 0; i < g_narenas; i++) {
+        malloc_t *arena = &g_arenas[i];
+        arena_lock(arena);
+        remote_drain(arena);
+        consolidate(arena);
+        released += heap_trim(&arena->heap, pad);
+        arena_unlock(arena);
+    }
+    return released != 0;
+}
+
+int mallopt(int param, int value)
+{
+    switch (param) {
+    case M_MXFAST:
+        if (value < 0 || value > QUICK_MAX_SIZE)
+            return 0;
+        g_quick_max = value;
+        return 1;
+    case M_TRIM_THRESHOLD:
+        if (value < 0)
+            return 0;
+        g_trim_threshold = value;
+        return 1;
+    case M_TOP_PAD:
+        if (value < 0)
+            return 0;
+        g_top_pad = value;
+        return 1;
+    case M_MMAP_THRESHOLD:
+        if (value < 0)
+            return 0;
+        g_mmap_threshold = value;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Take a snapshot of every arena, holding all of their mutexes at once as
+ * slab runs move between arenas; returns the number of arenas.
+ */
+static size_t snapshot(alloc_stats_t *arenas)
+{
+    pthread_once(&g_init_once, arenas_init);
+    for (size_t i = 0; i < g_narenas; i++)
+        arena_lock(&g_arenas[i]);
+    if (t_arena)
+        tcache_fold(t_arena);
+    for (size_t i = 0; i < g_narenas; i++) {
+        malloc_t *arena = &g_arenas[i];
+        memset(&arenas[i], 0, sizeof(arenas[i]));
+        stats_collect(&arenas[i], &arena->heap, &arena->free_index);
+        arenas[i].counters = arena->stats;
+    }
+    for (size_t i = g_narenas; i-- > 0;)
+        arena_unlock(&g_arenas[i]);
+    return g_narenas;
+}
+
+/* Report every heap block and slab object, holding every arena's mutex as
+ * snapshot() does: @fn must neither allocate nor free. Mapped blocks are
+ * linked nowhere and left out. Returns what @fn returned to stop the walk,
+ * 0 once it is complete.
+ */
+int malloc_walk(malloc_walk_fn fn, void *arg)
+{
+    int ret = 0;
+
+    pthread_once(&g_init_once, arenas_init);
+    for (size_t i = 0; i < g_narenas; i++)
+        arena_lock(&g_arenas[i]);
+    for (size_t i = 0; i < g_narenas && !ret; i++)
+        ret = stats_walk(&g_arenas[i].heap, fn, arg);
+    for (size_t i = g_narenas; i-- > 0;)
+        arena_unlock(&g_arenas[i]);
+    return ret;
+}
+
+struct mallinfo2 mallinfo2(void)
+{
+    alloc_stats_t arenas[MAX_ARENAS], total = {0};
+    struct mallinfo2 info = {0};
+    size_t n = snapshot(arenas);
+
+    for (size_t i = 0; i < n; i++)
+        stats_merge(&total, &arenas[i]);
+    info.arena = total.committed + total.slab_runs * SLAB_RUN_SIZE;
+    info.ordblks = total.free_blocks;
+    info.smblks = total.cached_blocks;
+    info.hblks = __atomic_load_n(&g_stats.mapped_blocks, __ATOMIC_RELAXED);
+    info.hblkhd = __atomic_load_n(&g_stats.mapped_bytes, __ATOMIC_RELAXED);
+    info.fsmblks = total.cached_bytes;
+    info.uordblks = total.used_bytes + total.slab_bytes;
+    info.fordblks = total.free_bytes + total.top_bytes;
+    info.keepcost = total.top_bytes;
+    return info;
+}
+
+void malloc_stats(void)
+{
+    malloc_stats_dump(stderr, MALLOC_STATS_TEXT);
+}
+
+int malloc_stats_dump(FILE *fp, int format)
+{
+    alloc_stats_t arenas[MAX_ARENAS];
+
+    if (!fp || (format != MALLOC_STATS_TEXT && format != MALLOC_STATS_JSON)) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* print once every mutex is released, stdio may allocate */
+    size_t n = snapshot(arenas);
+    stats_print(fp, arenas, n, format == MALLOC_STATS_JSON);
+    return 0;
+}
+
+int malloc_prof_dump(FILE *fp)
+{
+    pthread_once(&g_init_once, arenas_init);
+    return prof_dump(fp);
+}
+
+int malloc_heap_dump(FILE *fp)
+{
+    pthread_once(&g_init_once, arenas_init);
+    return sample_dump(fp);
+}
@@ -1,15 +1,99 @@
 #ifndef __XALLOC
 #define __XALLOC
 #include <pthread.h>
-#include "rbtree.h"
+#include "freelist.h"
+#include "slab.h"
+#include "stats.h"
+/* Per-thread cache of freed payloads, binned by exact usable size. */
+#define TCACHE_MAX_SIZE (1024)
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGN_BYTES(1) + 1)
+#define TCACHE_IDX(x) ((x) / ALIGN_BYTES(1))
+#define TCACHE_COUNT (16)
+#define TCACHE_BATCH (TCACHE_COUNT / 2)
+
+/* Per-arena quick lists of freed heap blocks, binned by exact usable size
+ * and left unmerged until they miss or hold QUICK_THRESHOLD blocks. Off
+ * until mallopt(M_MXFAST, bytes) sets the largest size they keep.
+ */
+#define QUICK_MAX_SIZE (4096)
+#define QUICK_BINS (QUICK_MAX_SIZE / ALIGN_BYTES(1) + 1)
+#define QUICK_IDX(x) ((x) / ALIGN_BYTES(1))
+#define QUICK_THRESHOLD (1024)
+
+/* mallopt() parameters, numbered as in glibc's <malloc.h>. */
+#ifndef M_MXFAST
+#define M_MXFAST (1)
+#endif
+#ifndef M_TRIM_THRESHOLD
+#define M_TRIM_THRESHOLD (-1)
+#endif
+#ifndef M_TOP_PAD
+#define M_TOP_PAD (-2)
+#endif
+#ifndef M_MMAP_THRESHOLD
+#define M_MMAP_THRESHOLD (-3)
+#endif
+
+/* One arena per online core, capped at MAX_ARENAS. */
+#define MAX_ARENAS (64)
+
 typedef struct {
-    rbnode_t *root_rbtree;
+    free_index_t free_index;
     pthread_mutex_t mutex;
+    heap_t heap;
+    slab_t slab;
+    size_t threads;
+    void *remote_free;
+    metadata_t *quick[QUICK_BINS];
+    size_t quick_count;
+    arena_stats_t stats;
+    uint64_t locked_at; /* for the profiler, by the mutex holder */
 } malloc_t;
 
+/* glibc's own, where it has one: mallinfo2() stands in for it. Elsewhere
+ * it is laid out the same.
+ */
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+#include <malloc.h>
+#else
+struct mallinfo2 {
+    size_t arena;    /* bytes committed to the heaps and slab runs */
+    size_t ordblks;  /* free blocks in the trees */
+    size_t smblks;   /* heap blocks parked in thread caches, quick lists */
+    size_t hblks;    /* mapped blocks */
+    size_t hblkhd;   /* bytes in mapped blocks */
+    size_t usmblks;  /* always 0 */
+    size_t fsmblks;  /* bytes in those parked blocks */
+    size_t uordblks; /* bytes in use */
+    size_t fordblks; /* free bytes, including the free ends of segments */
+    size_t keepcost; /* bytes at the free ends of segments */
+};
+#endif
+
+#define MALLOC_STATS_TEXT (0)
+#define MALLOC_STATS_JSON (1)
+
 void *malloc(size_t size);
 void free(void *ptr);
 void *calloc(size_t nmemb, size_t size);
 void *free_realloc(void *ptr);
 void *realloc(void *ptr, size_t size);
-#endif /* __XALLOC */
\ No newline at end of file
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+void *memalign(size_t alignment, size_t size);
+void *valloc(size_t size);
+void *pvalloc(size_t size);
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+size_t malloc_usable_size(void *ptr);
+size_t malloc_batch(size_t size, size_t count, void **out);
+void free_batch(void **ptrs, size_t count);
+int mallopt(int param, int value);
+int malloc_trim(size_t pad);
+struct mallinfo2 mallinfo2(void);
+void malloc_stats(void);
+int malloc_stats_dump(FILE *fp, int format);
+int malloc_walk(malloc_walk_fn fn, void *arg);
+int malloc_prof_dump(FILE *fp);
+int malloc_heap_dump(FILE *fp);
+#endif /* __XALLOC */